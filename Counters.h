@@ -0,0 +1,243 @@
+/********************
+*
+* NBODY SIMULATION HARDWARE COUNTERS
+*
+*********************/
+
+/***
+*
+* Counts what the CPU does during chosen phases of the simulation, through
+* perf_event_open, so a run reports the IPC, cache misses and vector work of
+* its force kernel without wrapping it in perf.
+*
+* Each thread taking part (the main thread and every pool worker) gets one
+* counter group of cycles, instructions, last level cache misses, packed
+* floating point instructions retired, and task-clock, user space only. The
+* phase is bracketed by begin() and end(phase, units), which read every group
+* and add the difference to the phase, scaled by the time the group was
+* actually on the PMU when the kernel multiplexes. units is the work done, so
+* the report can give each counter per pair interaction, body or frame.
+*
+* Counters that cannot be opened are left out and reported as such: packed FP
+* instructions need a raw event only known here for Intel (FP_ARITH_INST_
+* RETIRED), and virtual machines or a strict perf_event_paranoid may refuse
+* every hardware event. task-clock is a software event, so a run that may not
+* see the PMU still gets CPU time per unit. If not even that opens, open()
+* returns false and the counters do nothing.
+*
+***/
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+enum CounterKind {COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES, COUNTER_VECTOR_FP, COUNTER_TASK_CLOCK, COUNTER_KINDS};
+
+static const char *COUNTER_NAMES[COUNTER_KINDS] = {"cycles", "instructions", "LLC misses", "packed FP instructions", "CPU ns"};
+
+inline bool cpu_is_intel(){
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int eax, ebx, ecx, edx;
+	return __get_cpuid(0, &eax, &ebx, &ecx, &edx) && ebx == 0x756e6547 && edx == 0x49656e69 && ecx == 0x6c65746e; //"GenuineIntel"
+#else
+	return false;
+#endif
+}
+
+//Attributes of one kind of counter, false if there is no event for it on this CPU
+inline bool counter_attr(int kind, perf_event_attr &attr){
+	memset(&attr, 0, sizeof(attr));
+	attr.size           = sizeof(attr);
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+	attr.read_format    = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	switch(kind){
+		case COUNTER_CYCLES:
+			attr.type   = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CPU_CYCLES;
+			return true;
+		case COUNTER_INSTRUCTIONS:
+			attr.type   = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+			return true;
+		case COUNTER_LLC_MISSES:
+			attr.type   = PERF_TYPE_HW_CACHE;
+			attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+			return true;
+		case COUNTER_VECTOR_FP:
+			attr.type   = PERF_TYPE_RAW;
+			attr.config = 0xFCC7; //FP_ARITH_INST_RETIRED, 128, 256 and 512 bit packed single and double
+			return cpu_is_intel();
+		case COUNTER_TASK_CLOCK:
+			attr.type   = PERF_TYPE_SOFTWARE;
+			attr.config = PERF_COUNT_SW_TASK_CLOCK;
+			return true;
+	}
+	return false;
+}
+
+/***
+*
+* tids are the threads to count, names the phase_count phase names and units
+* what a unit of work in each phase is called. Both must outlive the counters.
+* open() returns false, with error saying why, if nothing could be counted.
+*
+***/
+struct PerfCounters {
+	int         *fd;      //Group members of each thread, COUNTER_KINDS apart
+	size_t       threads;
+	int          kinds[COUNTER_KINDS]; //Kind of each group member, in the order read
+	size_t       members;
+	const char  *error;   //Why hardware counters are missing, or nullptr
+	const char *const *names;
+	const char *const *units;
+	size_t       phase_count;
+	double      *totals;  //phase_count rows of COUNTER_KINDS
+	uint64_t    *work;    //Units of work done in each phase
+	double       start[COUNTER_KINDS];
+	uint64_t    *buffer;
+
+	bool open(const pid_t *tids, size_t count, const char *const phase_names[], const char *const phase_units[], size_t phases){
+		threads     = count;
+		names       = phase_names;
+		units       = phase_units;
+		phase_count = phases;
+		members     = 0;
+		error       = nullptr;
+		fd     = (int*) malloc(threads*COUNTER_KINDS*sizeof(int));
+		totals = (double*) calloc(phase_count*COUNTER_KINDS, sizeof(double));
+		work   = (uint64_t*) calloc(phase_count, sizeof(uint64_t));
+		buffer = (uint64_t*) malloc((3 + COUNTER_KINDS)*sizeof(uint64_t));
+		for(size_t i = 0; i < threads*COUNTER_KINDS; ++i){
+			fd[i] = -1;
+		}
+
+		//The kinds the first thread can open decide the group of every thread
+		for(int kind = 0; kind < COUNTER_KINDS; ++kind){
+			perf_event_attr attr;
+			if(!counter_attr(kind, attr)){
+				if(!error)
+					error = "no packed FP event known for this CPU";
+				continue;
+			}
+			int leader = members ? fd[0] : -1;
+			int f = syscall(SYS_perf_event_open, &attr, tids[0], -1, leader, 0);
+			if(f < 0){
+				if(!error || kind < COUNTER_VECTOR_FP)
+					error = strerror(errno);
+				continue;
+			}
+			fd[members] = f;
+			kinds[members++] = kind;
+		}
+		if(!members){
+			release();
+			return false;
+		}
+		for(size_t t = 1; t < threads; ++t){
+			for(size_t m = 0; m < members; ++m){
+				perf_event_attr attr;
+				counter_attr(kinds[m], attr);
+				int leader = m ? fd[t*COUNTER_KINDS] : -1;
+				fd[t*COUNTER_KINDS + m] = syscall(SYS_perf_event_open, &attr, tids[t], -1, leader, 0);
+				if(fd[t*COUNTER_KINDS + m] < 0){
+					error = strerror(errno);
+					release();
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	bool has(int kind) const {
+		for(size_t m = 0; m < members; ++m){
+			if(kinds[m] == kind)
+				return true;
+		}
+		return false;
+	}
+
+	void begin(){
+		read_all(start);
+	}
+
+	void end(size_t phase, uint64_t units_done){
+		double now[COUNTER_KINDS];
+		read_all(now);
+		for(int k = 0; k < COUNTER_KINDS; ++k){
+			totals[phase*COUNTER_KINDS + k] += now[k] - start[k];
+		}
+		work[phase] += units_done;
+	}
+
+	//One line per phase with each counter per unit of work
+	void report(FILE *out) const {
+		if(error)
+			fprintf(out, "Some hardware counters are unavailable (%s)\n", error);
+		for(size_t phase = 0; phase < phase_count; ++phase){
+			if(!work[phase])
+				continue;
+			const double *total = &totals[phase*COUNTER_KINDS];
+			fprintf(out, "%s per %s (%lu counted):", names[phase], units[phase], (unsigned long) work[phase]);
+			for(size_t m = 0; m < members; ++m){
+				fprintf(out, "%s %.4g %s", m ? "," : "", total[kinds[m]] / work[phase], COUNTER_NAMES[kinds[m]]);
+			}
+			if(has(COUNTER_CYCLES) && has(COUNTER_INSTRUCTIONS) && total[COUNTER_CYCLES] > 0)
+				fprintf(out, "; IPC %.2f", total[COUNTER_INSTRUCTIONS] / total[COUNTER_CYCLES]);
+			if(has(COUNTER_LLC_MISSES) && has(COUNTER_INSTRUCTIONS) && total[COUNTER_INSTRUCTIONS] > 0)
+				fprintf(out, ", %.3f LLC misses per 1000 instructions", 1000 * total[COUNTER_LLC_MISSES] / total[COUNTER_INSTRUCTIONS]);
+			fprintf(out, "\n");
+		}
+	}
+
+	void close(){
+		release();
+	}
+
+ private:
+	//Sum every thread's counters, scaled up for the time they were multiplexed out
+	void read_all(double *sum){
+		for(int k = 0; k < COUNTER_KINDS; ++k){
+			sum[k] = 0;
+		}
+		for(size_t t = 0; t < threads; ++t){
+			size_t bytes = (3 + members)*sizeof(uint64_t);
+			if(read(fd[t*COUNTER_KINDS], buffer, bytes) != (ssize_t) bytes)
+				continue;
+			double scale = buffer[2] ? (double) buffer[1] / buffer[2] : 0;
+			for(size_t m = 0; m < members && m < buffer[0]; ++m){
+				sum[kinds[m]] += buffer[3 + m] * scale;
+			}
+		}
+	}
+
+	void release(){
+		for(size_t i = 0; fd && i < threads*COUNTER_KINDS; ++i){
+			if(fd[i] >= 0)
+				::close(fd[i]);
+		}
+		free(fd);
+		free(totals);
+		free(work);
+		free(buffer);
+		fd      = nullptr;
+		totals  = nullptr;
+		work    = nullptr;
+		buffer  = nullptr;
+		members = 0;
+	}
+};
+
+#endif
@@ -0,0 +1,1858 @@
+/********************
+*
+* NBODY SIMULATION HISTORY FORMAT
+*
+*********************/
+
+/***
+*
+* A history file is a header followed by one record per simulated tick.
+*
+* Header: "NBODY SIMULATION", the body count and tick count as uint64_t, then
+* a second blurb naming the format version:
+*	"UNIVERSE HISTORY" - Version 1. No records, just fixed frames of body_count
+*	                     bodies followed by the barycenter, dead bodies zeroed.
+*	"UNIVERSE HIST V2" - Version 2. Tagged frame records carrying their own slot
+*	                     count, plus remap records giving the body ID in each
+*	                     slot after the simulator compacted its output.
+*	"UNIVERSE HIST V3" - Version 3. Version 2 plus the header extension below.
+*	"UNIVERSE HIST V4" - Version 4. Frames only hold live bodies, listing their
+*	                     IDs. No more remap records.
+*	"UNIVERSE HIST V5" - Version 5. Frames may use the compact or delta encoding.
+*	"UNIVERSE HIST V6" - Version 6. Frames are grouped into checksummed chunks,
+*	                     followed by a frame index.
+*
+* From version 3 on the header is followed by an extension: its size in bytes
+* (counting the size field itself) and then uint64_t fields, of which readers
+* use the ones they know and skip the rest. In order: dimensions, encoding,
+* field mask, quantisation bits, delta time (the bits of a double) and
+* keyframe interval.
+*
+* A body is stored as doubles: mass, radius, then dims components each of
+* position, velocity and acceleration. HistoryFrame holds frames decoded to
+* that layout whatever their encoding.
+*
+* Frame record (version 4 on): FRAME_TAG, the body count, the uint32_t ID of
+* each body zero padded to a multiple of 8 bytes, then
+*	ENCODING_FULL    - the bodies followed by the barycenter.
+*	ENCODING_COMPACT - the barycenter, then for each of position, velocity and
+*	                   acceleration in the field mask a double scale followed
+*	                   by one signed integer of the quantisation bits per
+*	                   component, relative to the barycenter; then if the
+*	                   mask has FIELD_MASS one float per body. Each block is
+*	                   zero padded to a multiple of 8 bytes. The radius is
+*	                   derived from the mass, and fields left out decode as 0.
+*	ENCODING_DELTA   - (the body count is followed by the size of the rest of
+*	                   the record) then 1 for a keyframe or 0, the number of
+*	                   blocks and the size of each, the barycenter, then the
+*	                   blocks, zero padded to a multiple of 8 bytes. See
+*	                   HistoryCodec.
+*
+* Chunks (version 6 on): CHUNK_TAG, the index of the first frame, the number
+* of frames, the size of the frame records that follow and their checksum().
+* A chunk of 0 frames was still being written when the simulator stopped and
+* ends the history. Delta encoded chunks always start on a keyframe.
+*
+* Index (version 6 on): INDEX_TAG, the number of frames, the frames per chunk
+* (every chunk but the last has that many), the number of chunks, the file
+* offset of every frame record, then of every chunk. The file ends with the
+* offset of the index and INDEX_TAG again. Files cut short have no index, so
+* readers rebuild it by walking the complete chunks.
+*
+* Column files ("UNIVERSE COLUMNS" in place of the version blurb) hold the
+* same data field-major, for reading one field of one body over many ticks.
+* The header extension holds the dimensions and ticks per block. Ticks are
+* grouped into blocks of that many (the last may be short); a block of T
+* ticks holds each column in turn (mass, radius, position, velocity,
+* acceleration), and each column holds, for body ID 0 to body_count (the
+* barycenter), that body's values for the T ticks. Bodies not live at a tick
+* are NaN. Every block but the last has the same size, so any run of values
+* is found without an index.
+*
+***/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <fcntl.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include "ThreadPool.h"
+
+static const char HISTORY_BLURB[16]   = {'N','B','O','D','Y',' ','S','I','M','U','L','A','T','I','O','N'};
+static const char HISTORY_VERSIONS[][16] = {
+	{'U','N','I','V','E','R','S','E',' ','H','I','S','T','O','R','Y'},
+	{'U','N','I','V','E','R','S','E',' ','H','I','S','T',' ','V','2'},
+	{'U','N','I','V','E','R','S','E',' ','H','I','S','T',' ','V','3'},
+	{'U','N','I','V','E','R','S','E',' ','H','I','S','T',' ','V','4'},
+	{'U','N','I','V','E','R','S','E',' ','H','I','S','T',' ','V','5'},
+	{'U','N','I','V','E','R','S','E',' ','H','I','S','T',' ','V','6'},
+};
+#define HISTORY_VERSION (sizeof(HISTORY_VERSIONS)/sizeof(HISTORY_VERSIONS[0]))
+
+static const char COLUMN_BLURB[16] = {'U','N','I','V','E','R','S','E',' ','C','O','L','U','M','N','S'};
+
+static const char FRAME_TAG[8] = {'F','R','A','M','E', 0 , 0 , 0 };
+static const char REMAP_TAG[8] = {'R','E','M','A','P', 0 , 0 , 0 };
+static const char CHUNK_TAG[8] = {'C','H','U','N','K', 0 , 0 , 0 };
+static const char INDEX_TAG[8] = {'I','N','D','E','X', 0 , 0 , 0 };
+
+enum HistoryEncoding {
+	ENCODING_FULL    = 0,
+	ENCODING_COMPACT = 1,
+	ENCODING_DELTA   = 2
+};
+
+#define DELTA_BLOCK_BODIES 1024 //Bodies per independently coded block of a delta frame
+#define CHUNK_FRAMES       64   //Frames per chunk, unless delta keyframes set the pace
+#define CHECKSUM_SEED      0xcbf29ce484222325ull
+#define COLUMN_TICKS       256  //Default ticks per column block
+#define COLUMN_BLOCK_BYTES (64ull << 20) //Column block size ticks per block is cut down to fit
+#define MAP_WINDOW_BYTES   (64ull << 20) //Size of each window of a memory mapped history
+#define URING_BUFFER_BYTES (4ull << 20)  //Size of each io_uring write
+#define URING_DEPTH        4    //io_uring writes in flight
+#define DIRECT_ALIGN       4096 //Alignment of O_DIRECT buffers, offsets and lengths
+#define URING_RETRIES      8    //Tries to submit a write interrupted by EINTR or EAGAIN
+
+//How ChunkWriter gets the history to the file
+enum OutputBackend {
+	OUTPUT_STDIO = 0,
+	OUTPUT_MMAP  = 1,
+	OUTPUT_URING = 2
+};
+
+enum HistoryColumn {
+	COLUMN_MASS,
+	COLUMN_RADIUS,
+	COLUMN_POS,
+	COLUMN_VEL,
+	COLUMN_ACC,
+	COLUMN_COUNT
+};
+
+enum HistoryField {
+	FIELD_POS  = 1,
+	FIELD_VEL  = 2,
+	FIELD_ACC  = 4,
+	FIELD_MASS = 8
+};
+
+#pragma pack(push, 1)
+struct HistoryHeader {
+	char     blurb1[16];
+	uint64_t body_count;
+	uint64_t tick_count;
+	char     blurb2[16];
+};
+
+struct ChunkHeader {
+	char     tag[8];
+	uint64_t first;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t sum;
+};
+#pragma pack(pop)
+
+//Everything the header says about the frames that follow
+struct HistoryInfo {
+	uint64_t body_count;
+	uint64_t tick_count;
+	uint64_t version;
+	uint64_t dims;
+	uint64_t encoding;
+	uint64_t fields;
+	uint64_t bits;
+	double   dt;
+	uint64_t keyframe;
+
+	size_t body_doubles() const {
+		return 2 + 3*dims;
+	}
+};
+
+inline size_t pad8(size_t bytes){
+	return (bytes + 7) / 8 * 8;
+}
+
+/***
+*
+* Running checksum over whole 8-byte words, which every record is made of.
+* One multiply per word keeps it far faster than the disk.
+*
+***/
+inline uint64_t checksum(uint64_t hash, const void *data, size_t bytes){
+	const unsigned char *p = (const unsigned char*) data;
+	for(size_t i = 0; i + 8 <= bytes; i += 8){
+		uint64_t word;
+		memcpy(&word, &p[i], sizeof(uint64_t));
+		hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+		hash ^= hash >> 29;
+	}
+	return hash;
+}
+
+inline double radius_of(double mass){
+	return sqrt(mass)*.25;
+}
+
+/***
+*
+* Parse a comma separated field list such as "pos,vel" into a field mask.
+*
+* Returns 0 if any name is not a field.
+*
+***/
+inline uint64_t parse_fields(const char *list){
+	static const char *names[] = {"pos", "vel", "acc", "mass"};
+	uint64_t mask = 0;
+	while(*list){
+		size_t len = strcspn(list, ",");
+		uint64_t field = 0;
+		for(int i = 0; i < 4; ++i){
+			if(strlen(names[i]) == len && !strncmp(list, names[i], len))
+				field = 1 << i;
+		}
+		if(!field)
+			return 0;
+		mask |= field;
+		list += len + (list[len] == ',');
+	}
+	return mask;
+}
+
+/***
+*
+* A decoded frame: count bodies in the layout described above, then the
+* barycenter. allocate() sizes it for the largest frame of the history.
+* index_rows() fills row with the row of each ID in the frame, for the delta
+* encoder to find bodies in it by ID.
+*
+***/
+struct HistoryFrame {
+	uint64_t  count;
+	uint32_t *id;
+	double   *body;
+	uint32_t *row;
+
+	void allocate(const HistoryInfo &info){
+		count = 0;
+		id    = (uint32_t*) calloc(info.body_count, sizeof(uint32_t));
+		body  = (double*)   calloc((info.body_count+1) * info.body_doubles(), sizeof(double));
+		row   = (uint32_t*) calloc(info.body_count, sizeof(uint32_t));
+	}
+	void release(){
+		free(id);
+		free(body);
+		free(row);
+	}
+	void index_rows(){
+		for(uint64_t i = 0; i < count; ++i){
+			row[id[i]] = i;
+		}
+	}
+	double *barycenter(const HistoryInfo &info){
+		return &body[count*info.body_doubles()];
+	}
+};
+
+inline void write_history_header(const HistoryInfo &info, FILE *bout){
+	unsigned short s = sizeof(uint64_t);
+	uint64_t dt_bits;
+	memcpy(&dt_bits, &info.dt, s);
+	uint64_t ext[] = {7*sizeof(uint64_t), info.dims, info.encoding, info.fields, info.bits, dt_bits, info.keyframe};
+	char dest_buf[32+sizeof(uint64_t)*2+sizeof(ext)];
+
+	memcpy(&dest_buf[00+s*0], HISTORY_BLURB, 16);
+	memcpy(&dest_buf[16+s*0], &info.body_count, s);
+	memcpy(&dest_buf[16+s*1], &info.tick_count, s);
+	memcpy(&dest_buf[16+s*2], HISTORY_VERSIONS[HISTORY_VERSION-1], 16);
+	memcpy(&dest_buf[32+s*2], ext, sizeof(ext));
+	fwrite(dest_buf, sizeof(char), sizeof(dest_buf), bout);
+	fflush(bout);
+}
+
+//Largest encoded size of a frame record holding count bodies
+inline size_t frame_record_size(const HistoryInfo &info, uint64_t count){
+	size_t size = sizeof(FRAME_TAG) + sizeof(uint64_t) + pad8(count*sizeof(uint32_t));
+	if(info.encoding == ENCODING_FULL)
+		return size + (count+1)*info.body_doubles()*sizeof(double);
+	if(info.encoding == ENCODING_DELTA){
+		uint64_t blocks = (count + DELTA_BLOCK_BODIES - 1) / DELTA_BLOCK_BODIES;
+		size_t values = count*info.body_doubles();
+		return size + sizeof(uint64_t)*(3 + blocks) + info.body_doubles()*sizeof(double) + pad8(values*sizeof(double) + (values+1)/2 + blocks);
+	}
+
+	size += info.body_doubles()*sizeof(double);
+	for(int f = 0; f < 3; ++f){
+		if(info.fields & (FIELD_POS << f))
+			size += sizeof(double) + pad8(count*info.dims*info.bits/8);
+	}
+	if(info.fields & FIELD_MASS)
+		size += pad8(count*sizeof(float));
+	return size;
+}
+
+/***
+*
+* Quantise component offset..offset+dims of every body relative to the same
+* components of the barycenter, scaled so the largest magnitude in the frame
+* maps to the largest integer of type Q.
+*
+***/
+template<typename Q>
+char *quantize(const HistoryInfo &info, HistoryFrame &frame, size_t offset, char *out){
+	const double *bary = frame.barycenter(info);
+	const double qmax = (double)((1ull << (sizeof(Q)*8 - 1)) - 1);
+	double max = 0;
+	for(uint64_t i = 0; i < frame.count; ++i){
+		for(uint64_t d = 0; d < info.dims; ++d){
+			max = fmax(max, fabs(frame.body[i*info.body_doubles() + offset + d] - bary[offset + d]));
+		}
+	}
+	double scale = max / qmax;
+	double inv   = scale > 0 ? 1/scale : 0;
+	memcpy(out, &scale, sizeof(double));
+	out += sizeof(double);
+
+	Q *q = (Q*) out;
+	for(uint64_t i = 0; i < frame.count; ++i){
+		for(uint64_t d = 0; d < info.dims; ++d){
+			q[i*info.dims + d] = (Q) lrint((frame.body[i*info.body_doubles() + offset + d] - bary[offset + d]) * inv);
+		}
+	}
+	size_t bytes = frame.count*info.dims*sizeof(Q);
+	memset(out + bytes, 0, pad8(bytes) - bytes);
+	return out + pad8(bytes);
+}
+
+template<typename Q>
+const char *dequantize(const HistoryInfo &info, HistoryFrame &frame, size_t offset, const char *in){
+	const double *bary = frame.barycenter(info);
+	double scale;
+	memcpy(&scale, in, sizeof(double));
+	in += sizeof(double);
+
+	const Q *q = (const Q*) in;
+	for(uint64_t i = 0; i < frame.count; ++i){
+		for(uint64_t d = 0; d < info.dims; ++d){
+			frame.body[i*info.body_doubles() + offset + d] = bary[offset + d] + q[i*info.dims + d] * scale;
+		}
+	}
+	return in + pad8(frame.count*info.dims*sizeof(Q));
+}
+
+/***
+*
+* Encode frame as a frame record into out, which must hold
+* frame_record_size(info, frame.count) bytes.
+*
+* Returns the size of the record.
+*
+***/
+inline size_t encode_frame(const HistoryInfo &info, HistoryFrame &frame, char *out){
+	char *start = out;
+	size_t bd = info.body_doubles();
+	memcpy(out, FRAME_TAG, sizeof(FRAME_TAG));
+	memcpy(out + sizeof(FRAME_TAG), &frame.count, sizeof(uint64_t));
+	out += sizeof(FRAME_TAG) + sizeof(uint64_t);
+	memset(out, 0, pad8(frame.count*sizeof(uint32_t)));
+	memcpy(out, frame.id, frame.count*sizeof(uint32_t));
+	out += pad8(frame.count*sizeof(uint32_t));
+
+	if(info.encoding == ENCODING_FULL){
+		memcpy(out, frame.body, (frame.count+1)*bd*sizeof(double));
+		return out - start + (frame.count+1)*bd*sizeof(double);
+	}
+
+	memcpy(out, frame.barycenter(info), bd*sizeof(double));
+	out += bd*sizeof(double);
+	for(int f = 0; f < 3; ++f){
+		if(!(info.fields & (FIELD_POS << f)))
+			continue;
+		if(info.bits == 16)
+			out = quantize<int16_t>(info, frame, 2 + f*info.dims, out);
+		else
+			out = quantize<int32_t>(info, frame, 2 + f*info.dims, out);
+	}
+	if(info.fields & FIELD_MASS){
+		float *m = (float*) out;
+		for(uint64_t i = 0; i < frame.count; ++i){
+			m[i] = frame.body[i*bd];
+		}
+		memset(out + frame.count*sizeof(float), 0, pad8(frame.count*sizeof(float)) - frame.count*sizeof(float));
+		out += pad8(frame.count*sizeof(float));
+	}
+	return out - start;
+}
+
+/***
+*
+* Decode the part of a frame record following the tag and body count, which
+* must already be stored in frame.count.
+*
+***/
+inline void decode_frame(const HistoryInfo &info, const char *in, HistoryFrame &frame){
+	size_t bd = info.body_doubles();
+	memcpy(frame.id, in, frame.count*sizeof(uint32_t));
+	in += pad8(frame.count*sizeof(uint32_t));
+
+	if(info.encoding == ENCODING_FULL){
+		memcpy(frame.body, in, (frame.count+1)*bd*sizeof(double));
+		return;
+	}
+
+	memcpy(frame.barycenter(info), in, bd*sizeof(double));
+	in += bd*sizeof(double);
+	memset(frame.body, 0, frame.count*bd*sizeof(double));
+	for(int f = 0; f < 3; ++f){
+		if(!(info.fields & (FIELD_POS << f)))
+			continue;
+		if(info.bits == 16)
+			in = dequantize<int16_t>(info, frame, 2 + f*info.dims, in);
+		else
+			in = dequantize<int32_t>(info, frame, 2 + f*info.dims, in);
+	}
+	if(info.fields & FIELD_MASS){
+		const float *m = (const float*) in;
+		for(uint64_t i = 0; i < frame.count; ++i){
+			frame.body[i*bd]     = m[i];
+			frame.body[i*bd + 1] = radius_of(m[i]);
+		}
+	}
+}
+
+/***
+*
+* Keyframe plus residual codec for ENCODING_DELTA, and the front end every
+* encoding goes through.
+*
+* Each body is predicted from its own values in the previous frame, found by
+* ID: position advanced by the velocity and acceleration over the delta
+* time, velocity by the acceleration, everything else unchanged. Keyframes
+* predict zero, so they can be decoded without any earlier frame. The
+* residual of each double is the XOR of its bits with the prediction's, which
+* leaves the leading bytes zero when the prediction is close. The entropy
+* stage stores the number of leading zero bytes of each residual as a nibble
+* (two per byte, low nibble first) followed by the remaining low bytes of
+* every residual, little endian.
+*
+* Bodies are split into blocks of DELTA_BLOCK_BODIES, coded independently.
+* The encoder predicts from the previous frame itself (see
+* HistoryFrame::index_rows()), so frames and blocks can all be encoded at
+* once: encode_block() each block into its own buffer, then assemble() the
+* record. encode() does both, on the pool if there is one. The decoder keeps
+* the last values of every ID instead, and decodes blocks on the pool. The
+* predictor uses fma() so encoder and decoder round the same way whatever
+* the compiler flags.
+*
+* The statistics may be updated from several threads at once.
+*
+***/
+struct HistoryCodec {
+	HistoryInfo info;
+	double     *prev;    //Last frame decoded, by body ID
+	char       *scratch; //Per-block output of encode()
+	std::atomic<uint64_t> frames;
+	std::atomic<uint64_t> raw_bytes;
+	std::atomic<uint64_t> coded_bytes;
+	std::atomic<uint64_t> busy_ns;
+	progschj::ThreadPool *pool;
+
+	//threads is the size of the codec pool, 0 to code on the calling thread
+	void init(const HistoryInfo &history, size_t threads){
+		info        = history;
+		prev        = nullptr;
+		scratch     = nullptr;
+		frames      = 0;
+		raw_bytes   = 0;
+		coded_bytes = 0;
+		busy_ns     = 0;
+		pool        = nullptr;
+		if(info.encoding == ENCODING_FULL)
+			return;
+		if(threads)
+			pool = new progschj::ThreadPool(threads); //Compact frames are encoded whole on it, delta frames by block
+		if(info.encoding != ENCODING_DELTA)
+			return;
+		prev    = (double*) calloc(info.body_count * info.body_doubles(), sizeof(double));
+		scratch = (char*)   malloc(blocks(info.body_count) * block_capacity());
+	}
+
+	void release(){
+		delete pool;
+		free(prev);
+		free(scratch);
+		pool    = nullptr;
+		prev    = nullptr;
+		scratch = nullptr;
+	}
+
+	bool keyframe(uint64_t index){
+		return info.keyframe < 2 || index % info.keyframe == 0;
+	}
+	uint64_t blocks(uint64_t count){
+		return (count + DELTA_BLOCK_BODIES - 1) / DELTA_BLOCK_BODIES;
+	}
+	//Largest output of encode_block()
+	size_t block_capacity(){
+		size_t values = DELTA_BLOCK_BODIES * info.body_doubles();
+		return values*sizeof(double) + (values+1)/2;
+	}
+
+	/***
+	*
+	* Encode the index-th frame as a record into out, which must hold
+	* frame_record_size(info, frame.count) bytes. Delta encoding needs the
+	* previous frame, with its rows indexed, unless this is a keyframe.
+	*
+	***/
+	size_t encode(HistoryFrame &frame, const HistoryFrame *previous, uint64_t index, char *out){
+		auto start = std::chrono::steady_clock::now();
+		size_t size;
+		if(info.encoding != ENCODING_DELTA){
+			size = encode_frame(info, frame, out);
+		} else {
+			const bool key = keyframe(index);
+			const uint64_t n = blocks(frame.count);
+			std::vector<uint64_t> sizes(n);
+			for_blocks(n, [this, &frame, previous, key, &sizes](uint64_t b){
+				sizes[b] = encode_block(frame, previous, b, key, &scratch[b*block_capacity()]);
+			});
+			size = assemble(frame, key, sizes.data(), scratch, block_capacity(), out);
+		}
+		account(frame.count, size, std::chrono::steady_clock::now() - start);
+		return size;
+	}
+
+	//Encode block b of frame into dst, which must hold block_capacity() bytes. Returns its size
+	size_t encode_block(const HistoryFrame &frame, const HistoryFrame *previous, uint64_t b, bool key, char *dst){
+		const size_t bd = info.body_doubles();
+		const uint64_t begin = b*DELTA_BLOCK_BODIES;
+		const uint64_t end   = (std::min)(frame.count, begin + DELTA_BLOCK_BODIES);
+		const size_t values  = (end - begin)*bd;
+		unsigned char *nibble = (unsigned char*) dst;
+		unsigned char *data   = nibble + (values+1)/2;
+		double guess[2 + 3*3] = { };
+		memset(nibble, 0, (values+1)/2);
+		for(uint64_t i = begin, v = 0; i < end; ++i){
+			const double *cur = &frame.body[i*bd];
+			if(!key)
+				predict(&previous->body[previous->row[frame.id[i]]*bd], guess);
+			for(size_t k = 0; k < bd; ++k, ++v){
+				uint64_t actual, predicted;
+				memcpy(&actual, &cur[k], sizeof(uint64_t));
+				memcpy(&predicted, &guess[k], sizeof(uint64_t));
+				uint64_t residual = actual ^ predicted;
+				unsigned zeros = residual ? __builtin_clzll(residual) / 8 : 8;
+				nibble[v/2] |= zeros << (4*(v&1));
+				memcpy(data, &residual, 8 - zeros);
+				data += 8 - zeros;
+			}
+		}
+		return data - nibble;
+	}
+
+	//Write the record of frame into out from its encoded blocks, block b starting at blocks + b*stride
+	size_t assemble(const HistoryFrame &frame, bool key, const uint64_t *sizes, const char *blocks_out, size_t stride, char *out){
+		const size_t bd = info.body_doubles();
+		const uint64_t n = blocks(frame.count);
+		const uint64_t is_key = key;
+		char *p = out;
+		memcpy(p, FRAME_TAG, sizeof(FRAME_TAG));
+		memcpy(p + sizeof(FRAME_TAG), &frame.count, sizeof(uint64_t));
+		p += sizeof(FRAME_TAG) + 2*sizeof(uint64_t); //Rest of record size filled in at the end
+		memset(p, 0, pad8(frame.count*sizeof(uint32_t)));
+		memcpy(p, frame.id, frame.count*sizeof(uint32_t));
+		p += pad8(frame.count*sizeof(uint32_t));
+		memcpy(p, &is_key, sizeof(uint64_t));
+		memcpy(p + sizeof(uint64_t), &n, sizeof(uint64_t));
+		memcpy(p + 2*sizeof(uint64_t), sizes, n*sizeof(uint64_t));
+		p += (2 + n)*sizeof(uint64_t);
+		memcpy(p, &frame.body[frame.count*bd], bd*sizeof(double));
+		p += bd*sizeof(double);
+		for(uint64_t b = 0; b < n; ++b){
+			memcpy(p, &blocks_out[b*stride], sizes[b]);
+			p += sizes[b];
+		}
+		size_t size = pad8(p - out);
+		memset(p, 0, size - (p - out));
+		uint64_t rest = size - sizeof(FRAME_TAG) - 2*sizeof(uint64_t);
+		memcpy(out + sizeof(FRAME_TAG) + sizeof(uint64_t), &rest, sizeof(uint64_t));
+		return size;
+	}
+
+	//Decode the record in, which starts after the body count, into frame. Returns false if it is malformed
+	bool decode(const char *in, size_t size, HistoryFrame &frame){
+		auto start = std::chrono::steady_clock::now();
+		bool ok = true;
+		if(info.encoding != ENCODING_DELTA){
+			decode_frame(info, in, frame);
+		} else {
+			ok = decode_delta(in, size, frame);
+		}
+		account(frame.count, size + sizeof(FRAME_TAG) + sizeof(uint64_t), std::chrono::steady_clock::now() - start);
+		return ok;
+	}
+
+	//Count a frame coded in the given time
+	void account(uint64_t count, size_t size, std::chrono::nanoseconds time){
+		busy_ns     += time.count();
+		raw_bytes   += sizeof(FRAME_TAG) + sizeof(uint64_t) + pad8(count*sizeof(uint32_t)) + (count+1)*info.body_doubles()*sizeof(double);
+		coded_bytes += size;
+		frames++;
+	}
+
+	double ratio(){
+		return coded_bytes ? (double)raw_bytes / coded_bytes : 0;
+	}
+	//Throughput in MB of uncoded frames per second of coding, per thread
+	double mb_per_second(){
+		return busy_ns ? raw_bytes * 1e3 / busy_ns : 0;
+	}
+
+ private:
+	void predict(const double *last, double *guess){
+		const uint64_t d = info.dims;
+		const double dt_sq_half = info.dt*info.dt*0.5;
+		guess[0] = last[0];
+		guess[1] = last[1];
+		for(uint64_t k = 0; k < d; ++k){
+			const double pos = last[2 + k], vel = last[2 + d + k], acc = last[2 + 2*d + k];
+			guess[2 + k]       = fma(acc, dt_sq_half, fma(vel, info.dt, pos));
+			guess[2 + d + k]   = fma(acc, info.dt, vel);
+			guess[2 + 2*d + k] = acc;
+		}
+	}
+
+	//Run task(block) for every block, on the pool if there is one
+	template<class F>
+	void for_blocks(uint64_t n, F task){
+		if(!pool || n < 2){
+			for(uint64_t b = 0; b < n; ++b){
+				task(b);
+			}
+			return;
+		}
+		std::vector<std::future<void>> done;
+		for(uint64_t b = 0; b < n; ++b){
+			done.push_back(pool->enqueue(task, b));
+		}
+		for(auto &f : done){
+			f.get();
+		}
+	}
+
+	bool decode_block(HistoryFrame &frame, uint64_t begin, uint64_t end, bool key, const unsigned char *src, size_t size){
+		const size_t bd = info.body_doubles();
+		const size_t values = (end - begin)*bd;
+		const unsigned char *nibble = src;
+		const unsigned char *data   = src + (values+1)/2;
+		const unsigned char *limit  = src + size;
+		double guess[2 + 3*3] = { };
+		if(size < (values+1)/2)
+			return false;
+		for(uint64_t i = begin, v = 0; i < end; ++i){
+			double *cur  = &frame.body[i*bd];
+			double *last = &prev[frame.id[i]*bd];
+			if(!key)
+				predict(last, guess);
+			for(size_t k = 0; k < bd; ++k, ++v){
+				unsigned zeros = (nibble[v/2] >> (4*(v&1))) & 15;
+				if(zeros > 8 || data + (8 - zeros) > limit)
+					return false;
+				uint64_t residual = 0, predicted;
+				memcpy(&residual, data, 8 - zeros);
+				data += 8 - zeros;
+				memcpy(&predicted, &guess[k], sizeof(uint64_t));
+				residual ^= predicted;
+				memcpy(&cur[k], &residual, sizeof(uint64_t));
+			}
+			memcpy(last, cur, bd*sizeof(double));
+		}
+		return data == limit;
+	}
+
+	bool decode_delta(const char *in, size_t size, HistoryFrame &frame){
+		const size_t bd = info.body_doubles();
+		const char *end = in + size;
+		uint64_t key, n;
+		size_t fixed = pad8(frame.count*sizeof(uint32_t)) + 2*sizeof(uint64_t);
+		if(size < fixed)
+			return false;
+		memcpy(frame.id, in, frame.count*sizeof(uint32_t));
+		in += pad8(frame.count*sizeof(uint32_t));
+		memcpy(&key, in, sizeof(uint64_t));
+		memcpy(&n, in + sizeof(uint64_t), sizeof(uint64_t));
+		in += 2*sizeof(uint64_t);
+		if(n != blocks(frame.count) || (size_t)(end - in) < (n + bd)*sizeof(uint64_t))
+			return false;
+		for(uint64_t i = 0; i < frame.count; ++i){
+			if(frame.id[i] >= info.body_count)
+				return false;
+		}
+		std::vector<uint64_t> offset(n + 1);
+		memcpy(&offset[1], in, n*sizeof(uint64_t));
+		in += n*sizeof(uint64_t);
+		memcpy(frame.barycenter(info), in, bd*sizeof(double));
+		in += bd*sizeof(double);
+		for(uint64_t b = 0; b < n; ++b){
+			offset[b+1] += offset[b];
+			if(offset[b+1] > (uint64_t)(end - in))
+				return false;
+		}
+
+		std::vector<char> ok(n, 1);
+		for_blocks(n, [this, &frame, &offset, &ok, key, in](uint64_t b){
+			uint64_t last = (std::min)(frame.count, (b+1)*DELTA_BLOCK_BODIES);
+			ok[b] = decode_block(frame, b*DELTA_BLOCK_BODIES, last, key, (const unsigned char*) in + offset[b], offset[b+1] - offset[b]);
+		});
+		for(uint64_t b = 0; b < n; ++b){
+			if(!ok[b])
+				return false;
+		}
+		return true;
+	}
+};
+
+/***
+*
+* Output written by copying into a memory map of the file, one window of
+* MAP_WINDOW_BYTES at a time. The file is fallocated up front to the size the
+* writer says it can reach, or a window at a time if that fails, and cut back
+* to what was written by close(). Finished windows are handed to a thread
+* that msyncs and unmaps them, so writeback never holds up the writer.
+*
+* The file must be open for reading as well as writing. write() appends at
+* the end; write_at() patches bytes already written, which may be in a
+* window already gone.
+*
+***/
+struct MappedOutput {
+	int      fd;
+	uint64_t end;      //File offset of the next byte written
+	uint64_t base;     //File offset of the current window
+	uint64_t reserved; //Bytes of file allocated
+	char    *map;
+
+	bool open(int file, uint64_t offset, uint64_t reserve){
+		fd       = file;
+		end      = offset;
+		map      = nullptr;
+		reserved = 0;
+		stop     = false;
+		if(!fallocate(fd, 0, 0, reserve))
+			reserved = reserve;
+		if(!move_window())
+			return false;
+		flusher = std::thread([this]{ run(); });
+		return true;
+	}
+
+	void write(const void *data, size_t bytes){
+		const char *src = (const char*) data;
+		while(bytes){
+			if(end == base + MAP_WINDOW_BYTES){
+				retire();
+				if(!move_window()){
+					fprintf(stderr, "Could not map history window at %lu!\n", end);
+					exit(EXIT_FAILURE);
+				}
+			}
+			size_t n = (std::min)((uint64_t) bytes, (uint64_t) (base + MAP_WINDOW_BYTES - end));
+			memcpy(map + (end - base), src, n);
+			end   += n;
+			src   += n;
+			bytes -= n;
+		}
+	}
+
+	void write_at(uint64_t at, const void *data, size_t bytes){
+		if(at >= base && at + bytes <= end){
+			memcpy(map + (at - base), data, bytes);
+		} else if(pwrite(fd, data, bytes, at) != (ssize_t) bytes){
+			fprintf(stderr, "Could not write history at %lu!\n", at);
+		}
+	}
+
+	//Unmap everything and cut the file to the bytes written
+	void close(){
+		retire();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stop = true;
+			condition.notify_one();
+		}
+		flusher.join();
+		if(ftruncate(fd, end))
+			fprintf(stderr, "Could not truncate history to %lu bytes!\n", end);
+	}
+
+ private:
+	bool move_window(){
+		base = end / MAP_WINDOW_BYTES * MAP_WINDOW_BYTES;
+		if(base + MAP_WINDOW_BYTES > reserved){
+			if(fallocate(fd, 0, base, MAP_WINDOW_BYTES) && ftruncate(fd, base + MAP_WINDOW_BYTES))
+				return false;
+			reserved = base + MAP_WINDOW_BYTES;
+		}
+		void *mem = mmap(nullptr, MAP_WINDOW_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+		if(mem == MAP_FAILED)
+			return false;
+		map = (char*) mem;
+		madvise(map, MAP_WINDOW_BYTES, MADV_SEQUENTIAL);
+		return true;
+	}
+
+	void retire(){
+		std::unique_lock<std::mutex> lock(mutex);
+		retired.push_back(map);
+		condition.notify_one();
+	}
+
+	void run(){
+		std::unique_lock<std::mutex> lock(mutex);
+		for(;;){
+			condition.wait(lock, [this]{ return stop || !retired.empty(); });
+			if(retired.empty())
+				return; //Stopped and drained
+			char *window = retired.front();
+			retired.erase(retired.begin());
+			lock.unlock();
+			msync(window, MAP_WINDOW_BYTES, MS_SYNC);
+			madvise(window, MAP_WINDOW_BYTES, MADV_DONTNEED);
+			munmap(window, MAP_WINDOW_BYTES);
+			lock.lock();
+		}
+	}
+
+	bool               stop;
+	std::vector<char*> retired;
+	std::mutex         mutex;
+	std::condition_variable condition;
+	std::thread        flusher;
+};
+
+/***
+*
+* Output written in URING_BUFFER_BYTES buffers, aligned for O_DIRECT, through
+* a second descriptor of the file opened with O_DIRECT, so the history does
+* not go through (and evict the simulation from) the page cache. Up to
+* URING_DEPTH buffers are written by io_uring while the next one fills. If
+* the kernel has no io_uring the buffers are written with pwrite() instead,
+* and if the file system refuses O_DIRECT they go through the page cache.
+* A write the ring will not take, or that completes short or with an error,
+* is finished with pwrite(); a submit that keeps failing, or a write refused
+* as invalid or unsupported, also turns io_uring off for the rest of the run.
+*
+* Every write covers whole DIRECT_ALIGN blocks, so the first buffer starts
+* with the bytes already in the file before the aligned offset, and a buffer
+* written before it is full (by flush()) is padded with zeros and written
+* again once it fills. close() cuts the padding off.
+*
+* write_at() patches bytes in the buffer being filled in place. Patches to
+* bytes already handed over wait until no write in flight covers them, and
+* are then made with pwrite() on the original descriptor.
+*
+***/
+struct UringOutput {
+	int      fd;      //Original descriptor, for patches
+	int      direct;  //O_DIRECT descriptor, if the file system allows it
+	bool     uring;   //Whether io_uring is in use, rather than pwrite()
+	uint64_t end;     //File offset of the next byte written
+
+	bool open(int file, uint64_t offset){
+		fd     = file;
+		end    = offset;
+		direct = ::open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_WRONLY | O_DIRECT);
+		if(direct < 0)
+			direct = ::open(("/proc/self/fd/" + std::to_string(fd)).c_str(), O_WRONLY);
+		if(direct < 0)
+			return false;
+		uring = setup_ring();
+		bool allocated = true;
+		for(int b = 0; b <= URING_DEPTH; ++b){
+			buffer[b].data = (char*) aligned_alloc(DIRECT_ALIGN, URING_BUFFER_BYTES);
+			buffer[b].busy = false;
+			allocated &= buffer[b].data != nullptr;
+		}
+		current = 0;
+		buffer[0].offset = offset / DIRECT_ALIGN * DIRECT_ALIGN;
+		fill = offset - buffer[0].offset;
+		if(!allocated || (fill && pread(fd, buffer[0].data, fill, buffer[0].offset) != (ssize_t) fill)){
+			release();
+			return false;
+		}
+		return true;
+	}
+
+	void write(const void *data, size_t bytes){
+		const char *src = (const char*) data;
+		while(bytes){
+			size_t n = (std::min)((uint64_t) bytes, (uint64_t) (URING_BUFFER_BYTES - fill));
+			memcpy(buffer[current].data + fill, src, n);
+			fill  += n;
+			end   += n;
+			src   += n;
+			bytes -= n;
+			if(fill == URING_BUFFER_BYTES)
+				next_buffer();
+		}
+	}
+
+	void write_at(uint64_t at, const void *data, size_t bytes){
+		const char *src = (const char*) data;
+		uint64_t start = buffer[current].offset;
+		if(at + bytes > start){
+			uint64_t from = (std::max)(at, start);
+			memcpy(buffer[current].data + (from - start), src + (from - at), at + bytes - from);
+			if(at >= start)
+				return;
+			bytes = start - at;
+		}
+		patches.push_back({at, std::vector<char>(src, src + bytes)});
+		apply_patches();
+	}
+
+	//Get everything written so far to the file, as far as the kernel
+	void flush(){
+		if(fill){
+			size_t length = (fill + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+			memset(buffer[current].data + fill, 0, length - fill);
+			send(current, length);
+		}
+		while(in_flight)
+			reap();
+		apply_patches();
+	}
+
+	void close(){
+		flush();
+		if(ftruncate(fd, end))
+			fprintf(stderr, "Could not truncate history to %lu bytes!\n", end);
+		release();
+	}
+
+ private:
+	struct Buffer {
+		char    *data;
+		uint64_t offset;
+		size_t   length; //Bytes being written
+		bool     busy;
+	};
+	struct Patch {
+		uint64_t at;
+		std::vector<char> bytes;
+	};
+
+	//Hand over the full current buffer and start filling a free one
+	void next_buffer(){
+		uint64_t offset = buffer[current].offset + URING_BUFFER_BYTES;
+		send(current, URING_BUFFER_BYTES);
+		for(;;){
+			for(int b = 0; b <= URING_DEPTH; ++b){
+				if(!buffer[b].busy){
+					current = b;
+					buffer[b].offset = offset;
+					fill = 0;
+					return;
+				}
+			}
+			reap();
+		}
+	}
+
+	void send(int b, size_t length){
+		buffer[b].length = length;
+		buffer[b].busy   = true;
+		if(!uring){
+			write_buffer(b, 0);
+			buffer[b].busy = false;
+			return;
+		}
+		unsigned tail = *sq_tail;
+		unsigned index = tail & *sq_mask;
+		io_uring_sqe &sqe = sqes[index];
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode    = IORING_OP_WRITE;
+		sqe.fd        = direct;
+		sqe.addr      = (uint64_t) buffer[b].data;
+		sqe.len       = length;
+		sqe.off       = buffer[b].offset;
+		sqe.user_data = b;
+		sq_array[index] = index;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+		long submitted;
+		int tries = 0;
+		do {
+			submitted = syscall(__NR_io_uring_enter, ring, 1, 0, 0, nullptr, 0);
+		} while(submitted < 0 && (errno == EINTR || errno == EAGAIN) && ++tries < URING_RETRIES);
+		if(submitted == 1){
+			in_flight++;
+			return;
+		}
+		//Not taken by the kernel: withdraw it, write it here and stop using the ring
+		if(__atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == tail)
+			__atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+		fprintf(stderr, "Could not submit history write (%s), writing without io_uring\n", submitted < 0 ? strerror(errno) : "not taken");
+		uring = false;
+		write_buffer(b, 0);
+		buffer[b].busy = false;
+	}
+
+	//Write buffer b from byte done on with pwrite(), through the page cache if O_DIRECT refuses it
+	void write_buffer(int b, size_t done){
+		Buffer &w = buffer[b];
+		int out = direct;
+		while(done < w.length){
+			ssize_t n = pwrite(out, w.data + done, w.length - done, w.offset + done);
+			if(n > 0){
+				done += n;
+			} else if(n < 0 && errno == EINVAL && out != fd){
+				out = fd;
+			} else if(!(n < 0 && errno == EINTR)){
+				fprintf(stderr, "Could not write history at %lu!\n", w.offset + done);
+				return;
+			}
+		}
+	}
+
+	//Wait for at least one write in flight to finish
+	void reap(){
+		unsigned head = *cq_head;
+		while(head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)){
+			syscall(__NR_io_uring_enter, ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+		}
+		for(; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); ++head){
+			const io_uring_cqe &cqe = cqes[head & *cq_mask];
+			Buffer &done = buffer[cqe.user_data];
+			if(cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP){
+				if(uring)
+					fprintf(stderr, "io_uring cannot write the history (%s), writing without it\n", strerror(-cqe.res));
+				uring = false;
+			}
+			if(cqe.res != (int) done.length)
+				write_buffer(cqe.user_data, cqe.res > 0 ? cqe.res : 0); //Failed or short: finish it here
+			done.busy = false;
+			in_flight--;
+		}
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		apply_patches();
+	}
+
+	void apply_patches(){
+		for(size_t i = 0; i < patches.size();){
+			Patch &patch = patches[i];
+			bool covered = false;
+			for(int b = 0; b <= URING_DEPTH; ++b){
+				Buffer &w = buffer[b];
+				covered |= w.busy && patch.at < w.offset + w.length && patch.at + patch.bytes.size() > w.offset;
+			}
+			if(covered){
+				++i;
+				continue;
+			}
+			if(pwrite(fd, patch.bytes.data(), patch.bytes.size(), patch.at) != (ssize_t) patch.bytes.size())
+				fprintf(stderr, "Could not write history at %lu!\n", patch.at);
+			patches.erase(patches.begin() + i);
+		}
+	}
+
+	//Close the O_DIRECT descriptor and the ring and free the buffers, leaving the original descriptor open
+	void release(){
+		if(direct != fd)
+			::close(direct);
+		for(int b = 0; b <= URING_DEPTH; ++b){
+			free(buffer[b].data);
+		}
+		if(ring >= 0){
+			munmap(sq_ring, sq_ring_size);
+			munmap(sqes, sqes_size);
+			if(cq_ring != sq_ring)
+				munmap(cq_ring, cq_ring_size);
+			::close(ring);
+		}
+	}
+
+	bool setup_ring(){
+		io_uring_params params = { };
+		in_flight = 0;
+		ring = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+		if(ring < 0)
+			return false;
+		sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+		if(params.features & IORING_FEAT_SINGLE_MMAP)
+			sq_ring_size = cq_ring_size = (std::max)(sq_ring_size, cq_ring_size);
+		sqes_size = params.sq_entries*sizeof(io_uring_sqe);
+		void *sq  = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+		void *cq  = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+		void *sqe = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+		if(sq == MAP_FAILED || cq == MAP_FAILED || sqe == MAP_FAILED){
+			::close(ring);
+			ring = -1;
+			return false;
+		}
+		sq_ring  = (char*) sq;
+		cq_ring  = (char*) cq;
+		sqes     = (io_uring_sqe*) sqe;
+		sq_head  = (unsigned*) (sq_ring + params.sq_off.head);
+		sq_tail  = (unsigned*) (sq_ring + params.sq_off.tail);
+		sq_mask  = (unsigned*) (sq_ring + params.sq_off.ring_mask);
+		sq_array = (unsigned*) (sq_ring + params.sq_off.array);
+		cq_head  = (unsigned*) (cq_ring + params.cq_off.head);
+		cq_tail  = (unsigned*) (cq_ring + params.cq_off.tail);
+		cq_mask  = (unsigned*) (cq_ring + params.cq_off.ring_mask);
+		cqes     = (io_uring_cqe*) (cq_ring + params.cq_off.cqes);
+		return true;
+	}
+
+	Buffer   buffer[URING_DEPTH + 1];
+	int      current;
+	size_t   fill;    //Bytes of the current buffer filled
+	unsigned in_flight;
+	std::vector<Patch> patches;
+	int      ring;
+	char    *sq_ring;
+	char    *cq_ring;
+	size_t   sq_ring_size;
+	size_t   cq_ring_size;
+	size_t   sqes_size;
+	io_uring_sqe *sqes;
+	io_uring_cqe *cqes;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+};
+
+//Frames per chunk; delta encoded chunks hold one keyframe interval so they always start on a keyframe
+inline uint64_t chunk_frames_for(const HistoryInfo &info){
+	if(info.encoding == ENCODING_DELTA && info.keyframe >= 2)
+		return info.keyframe;
+	return CHUNK_FRAMES;
+}
+
+/***
+*
+* Writes frame records into chunks and the index after the header.
+*
+* Each chunk header is written as a placeholder of 0 frames and filled in
+* once the chunk is complete, so a file cut short at any point still reads
+* up to its last complete chunk. close() writes the index and corrects the
+* header's tick count to the frames actually written.
+*
+* With OUTPUT_MMAP the file is written through a MappedOutput, with room
+* reserved for info.tick_count frames of every body, and with OUTPUT_URING
+* through an UringOutput. flush() gets everything written so far into the
+* file, for the kernel to write back.
+*
+***/
+struct ChunkWriter {
+	FILE    *bout;
+	uint64_t chunk_frames;
+	uint64_t offset;  //File offset of the next byte written
+	ChunkHeader chunk;
+	std::vector<uint64_t> frame_offset;
+	std::vector<uint64_t> chunk_offset;
+	MappedOutput *mapped;
+	UringOutput  *uring;
+
+	//Call right after write_history_header()
+	bool open(FILE *out, const HistoryInfo &info, int output = OUTPUT_STDIO){
+		bout         = out;
+		chunk_frames = chunk_frames_for(info);
+		offset       = ftell(bout);
+		chunk        = { };
+		frame_offset.clear();
+		chunk_offset.clear();
+		return start_output(info, output);
+	}
+
+	//Most bytes a history of info.tick_count frames can take, header and index included
+	static uint64_t bound(const HistoryInfo &info){
+		uint64_t chunks = (info.tick_count + chunk_frames_for(info) - 1) / chunk_frames_for(info);
+		return 512 + info.tick_count*(frame_record_size(info, info.body_count) + sizeof(uint64_t))
+			+ chunks*(sizeof(ChunkHeader) + sizeof(uint64_t)) + 2*sizeof(INDEX_TAG) + 4*sizeof(uint64_t);
+	}
+
+	/***
+	*
+	* Carry on an existing history after its first frames, which must fill
+	* whole chunks and end at offset. frames and chunks are the offsets a
+	* HistoryReader found in the file; anything after offset is cut off.
+	*
+	* Returns false if the history does not hold those frames.
+	*
+	***/
+	bool resume(FILE *out, const HistoryInfo &info, const std::vector<uint64_t> &frames, const std::vector<uint64_t> &chunks, uint64_t count, uint64_t end, int output = OUTPUT_STDIO){
+		bout         = out;
+		chunk_frames = chunk_frames_for(info);
+		offset       = end;
+		chunk        = { };
+		if(count % chunk_frames || count > frames.size() || count / chunk_frames > chunks.size())
+			return false;
+		if(count < frames.size() && frames[count] != end + sizeof(ChunkHeader))
+			return false; //end is not where the next chunk starts
+		frame_offset.assign(frames.begin(), frames.begin() + count);
+		chunk_offset.assign(chunks.begin(), chunks.begin() + count / chunk_frames);
+		fflush(bout);
+		return !ftruncate(fileno(bout), offset) && !fseek(bout, offset, SEEK_SET) && start_output(info, output);
+	}
+
+	void append(const char *record, size_t length){
+		if(!chunk.frames){
+			memcpy(chunk.tag, CHUNK_TAG, sizeof(CHUNK_TAG));
+			chunk.first = frame_offset.size();
+			chunk.sum   = CHECKSUM_SEED;
+			chunk_offset.push_back(offset);
+			ChunkHeader placeholder = { };
+			memcpy(placeholder.tag, CHUNK_TAG, sizeof(CHUNK_TAG));
+			placeholder.first = chunk.first;
+			put(&placeholder, sizeof(ChunkHeader));
+		}
+		frame_offset.push_back(offset);
+		put(record, length);
+		chunk.bytes += length;
+		chunk.sum    = checksum(chunk.sum, record, length);
+		if(++chunk.frames == chunk_frames)
+			finish_chunk();
+	}
+
+	void close(){
+		if(chunk.frames)
+			finish_chunk();
+		uint64_t index_offset = offset;
+		uint64_t counts[] = {frame_offset.size(), chunk_frames, chunk_offset.size()};
+		put(INDEX_TAG, sizeof(INDEX_TAG));
+		put(counts, 3*sizeof(uint64_t));
+		put(frame_offset.data(), frame_offset.size()*sizeof(uint64_t));
+		put(chunk_offset.data(), chunk_offset.size()*sizeof(uint64_t));
+		put(&index_offset, sizeof(uint64_t));
+		put(INDEX_TAG, sizeof(INDEX_TAG));
+		put_at(offsetof(HistoryHeader, tick_count), &counts[0], sizeof(uint64_t));
+		if(mapped){
+			mapped->close();
+			delete mapped;
+			mapped = nullptr;
+			fseek(bout, offset, SEEK_SET);
+		}
+		if(uring){
+			uring->close();
+			delete uring;
+			uring = nullptr;
+			fseek(bout, offset, SEEK_SET);
+		}
+		fflush(bout);
+	}
+
+	void flush(){
+		if(uring)
+			uring->flush();
+		fflush(bout);
+	}
+
+ private:
+	bool start_output(const HistoryInfo &info, int output){
+		mapped = nullptr;
+		uring  = nullptr;
+		fflush(bout);
+		if(output == OUTPUT_URING){
+			uring = new UringOutput;
+			if(uring->open(fileno(bout), offset))
+				return true;
+			delete uring;
+			uring = nullptr;
+			return false;
+		}
+		if(output != OUTPUT_MMAP)
+			return true;
+		mapped = new MappedOutput;
+		if(mapped->open(fileno(bout), offset, bound(info)))
+			return true;
+		delete mapped;
+		mapped = nullptr;
+		return false;
+	}
+
+	void put(const void *data, size_t bytes){
+		if(mapped){
+			mapped->write(data, bytes);
+		} else if(uring){
+			uring->write(data, bytes);
+		} else {
+			fwrite(data, sizeof(char), bytes, bout);
+		}
+		offset += bytes;
+	}
+
+	void put_at(uint64_t at, const void *data, size_t bytes){
+		if(mapped){
+			mapped->write_at(at, data, bytes);
+			return;
+		}
+		if(uring){
+			uring->write_at(at, data, bytes);
+			return;
+		}
+		fseek(bout, at, SEEK_SET);
+		fwrite(data, sizeof(char), bytes, bout);
+		fseek(bout, offset, SEEK_SET);
+	}
+
+	void finish_chunk(){
+		put_at(chunk_offset.back(), &chunk, sizeof(ChunkHeader));
+		chunk = { };
+	}
+};
+
+/***
+*
+* Reader for every version of the format.
+*
+* open() returns 0 on success, 1 on failure.
+* next_frame() reads the next frame into frame, and returns 0 on success, 1 on
+* proper EOF, and 2 in the case of an error.
+*	(Proper EOF := EOF occurs at the end of a simulation frame)
+* seek() makes tick the next frame read, returning 0 on success and 2 if the
+* history has no such frame or cannot seek (versions 1 to 5).
+*
+* threads is the size of the pool decoding delta encoded frames.
+*
+* Version 6 checksums are checked as each chunk is read to its end, and
+* info.tick_count is the number of frames the file really holds.
+*
+* map_file() switches a version 6 reader to reading a memory map of the whole
+* file, which finds frames through the index and decodes them in place, so
+* frames that are never read are never paged in. set_stride() tells it how
+* far apart the frames read will be: 1 advises the kernel to read ahead,
+* anything larger to only fetch the pages of the next frame due.
+*
+***/
+struct HistoryReader {
+	FILE        *bin;
+	HistoryInfo  info;
+	HistoryFrame frame;
+	char        *record;  //Encoded record staging buffer
+	uint32_t    *slot_id; //Body ID in each slot, for versions 1 to 3
+	HistoryCodec codec;
+	uint64_t     tick;    //Frame next_frame() reads next
+	uint64_t     chunk_frames;
+	uint64_t     chunk_left;   //Frames left in the current chunk
+	uint64_t     chunk_sum;    //Checksum the current chunk should have
+	uint64_t     chunk_hash;   //Checksum of the part of it read so far
+	bool         chunk_verify; //Whether the current chunk is being read from its start
+	std::vector<uint64_t> frame_offset;
+	std::vector<uint64_t> chunk_offset;
+	const char  *map;     //Whole file, once map_file() succeeds
+	size_t       map_size;
+	uint64_t     stride;
+
+	int open(FILE *in, size_t threads = 2){
+		bin = in;
+		map = nullptr;
+		stride = 1;
+		HistoryHeader head;
+		if(!bin || 1 != fread(&head, sizeof(HistoryHeader), 1, bin)){
+			//Could not read header at all.
+			return 1;
+		}
+		if(memcmp(head.blurb1, HISTORY_BLURB, 16)){
+			//Blurb does not match expected value, indicating a malformed simulation history binary.
+			return 1;
+		}
+		info = { };
+		info.body_count = head.body_count;
+		info.tick_count = head.tick_count;
+		for(size_t v = 0; v < HISTORY_VERSION; ++v){
+			if(!memcmp(head.blurb2, HISTORY_VERSIONS[v], 16))
+				info.version = v + 1;
+		}
+		if(!info.version){
+			//Unknown format version
+			return 1;
+		}
+		info.dims = 2;
+		if(info.version >= 3){
+			uint64_t ext_size;
+			if(1 != fread(&ext_size, sizeof(uint64_t), 1, bin) || ext_size < 2*sizeof(uint64_t))
+				return 1;
+			uint64_t dt_bits = 0;
+			uint64_t *fields[] = {&info.dims, &info.encoding, &info.fields, &info.bits, &dt_bits, &info.keyframe};
+			size_t known = 0;
+			for(; known < 6 && (known+2)*sizeof(uint64_t) <= ext_size; ++known){
+				if(1 != fread(fields[known], sizeof(uint64_t), 1, bin))
+					return 1;
+			}
+			if(fseek(bin, ext_size - (known+1)*sizeof(uint64_t), SEEK_CUR)) //Skip extension fields added by newer simulators
+				return 1;
+			memcpy(&info.dt, &dt_bits, sizeof(double));
+		}
+		if(info.dims < 2 || info.dims > 3 || info.encoding > ENCODING_DELTA)
+			return 1;
+		if(info.encoding == ENCODING_COMPACT && (info.bits != 16 && info.bits != 32))
+			return 1;
+
+		frame.allocate(info);
+		record  = (char*)     malloc(frame_record_size(info, info.body_count));
+		slot_id = (uint32_t*) malloc(info.body_count * sizeof(uint32_t));
+		for(uint64_t i = 0; i < info.body_count; ++i){
+			slot_id[i] = i;
+		}
+		frame.count  = info.body_count;
+		tick         = 0;
+		chunk_left   = 0;
+		chunk_frames = 0;
+		frame_offset.clear();
+		chunk_offset.clear();
+		codec.init(info, threads);
+		if(info.version >= 6){
+			long frames_start = ftell(bin);
+			if(!read_index() && !scan_chunks(frames_start))
+				return 1;
+			info.tick_count = frame_offset.size();
+			if(fseek(bin, frames_start, SEEK_SET))
+				return 1;
+		}
+		return 0;
+	}
+
+	int next_frame(){
+		if(map)
+			return next_mapped();
+		if(info.version >= 6){
+			if(tick == frame_offset.size())
+				return 1; //Proper EOF
+			if(!chunk_left){
+				ChunkHeader chunk;
+				if(1 != fread(&chunk, sizeof(ChunkHeader), 1, bin) || memcmp(chunk.tag, CHUNK_TAG, 8) || !chunk.frames)
+					return 2;
+				chunk_left   = chunk.frames;
+				chunk_sum    = chunk.sum;
+				chunk_hash   = CHECKSUM_SEED;
+				chunk_verify = true;
+			}
+		}
+		if(info.version >= 2){
+			char tag[16];
+			uint64_t count;
+			for(;;){
+				size_t read_count = fread(tag, sizeof(char), 8, bin);
+				if(read_count == 0)
+					return 1; //Proper EOF
+				if(read_count != 8 || 1 != fread(&count, sizeof(uint64_t), 1, bin) || count > info.body_count)
+					return 2;
+				if(!memcmp(tag, FRAME_TAG, 8))
+					break;
+				if(info.version >= 4 || memcmp(tag, REMAP_TAG, 8))
+					return 2; //Unknown record
+				uint64_t *ids = (uint64_t*) record; //Remap IDs are uint64_t, and never larger than a frame
+				if(count != fread(ids, sizeof(uint64_t), count, bin))
+					return 2; //Truncated remap
+				for(uint64_t i = 0; i < count; ++i){
+					slot_id[i] = ids[i];
+				}
+				frame.count = count;
+			}
+			if(info.version >= 4){
+				size_t size = frame_record_size(info, count) - sizeof(FRAME_TAG) - sizeof(uint64_t);
+				uint64_t rest = 0;
+				if(info.encoding == ENCODING_DELTA){
+					if(1 != fread(&rest, sizeof(uint64_t), 1, bin) || rest > size)
+						return 2;
+					size = rest;
+				}
+				if(1 != fread(record, size, 1, bin))
+					return 2;
+				frame.count = count;
+				if(info.version >= 6){
+					memcpy(&tag[8], &count, sizeof(uint64_t));
+					chunk_hash = checksum(chunk_hash, tag, sizeof(tag));
+					if(info.encoding == ENCODING_DELTA)
+						chunk_hash = checksum(chunk_hash, &rest, sizeof(uint64_t));
+					chunk_hash = checksum(chunk_hash, record, size);
+					if(!--chunk_left && chunk_verify && chunk_hash != chunk_sum)
+						return 2; //Corrupt chunk
+				}
+				if(!codec.decode(record, size, frame))
+					return 2;
+				tick++;
+				return 0;
+			}
+			if(count != frame.count)
+				return 2; //Frame does not match the current slot assignment
+		}
+
+		size_t body_bytes = info.body_doubles() * sizeof(double);
+		size_t read_count = fread(frame.body, body_bytes, frame.count+1, bin);
+		if(frame.count+1 != read_count){
+			if(read_count == 0 && info.version == 1){
+				return 1; //Proper EOF
+			} else {
+				return 2; //Couldn't read, or an EOF occurs mid-frame
+			}
+		}
+		memcpy(frame.id, slot_id, frame.count*sizeof(uint32_t));
+		tick++;
+		return 0;
+	}
+
+	int seek(uint64_t target){
+		if(info.version < 6 || target >= frame_offset.size())
+			return 2;
+		if(info.encoding == ENCODING_DELTA){
+			//Decode forward, from the keyframe starting the chunk unless already in it
+			uint64_t chunk = target / chunk_frames;
+			if(tick > target || tick / chunk_frames != chunk){
+				if(!map && fseek(bin, chunk_offset[chunk], SEEK_SET))
+					return 2;
+				tick       = chunk * chunk_frames;
+				chunk_left = 0;
+			}
+			while(tick < target){
+				if(next_frame())
+					return 2;
+			}
+			return 0;
+		}
+		if(!map && fseek(bin, frame_offset[target], SEEK_SET))
+			return 2;
+		tick         = target;
+		chunk_left   = (std::min)(chunk_frames - target % chunk_frames, frame_offset.size() - target);
+		chunk_verify = false;
+		return 0;
+	}
+
+	bool map_file(){
+		if(info.version < 6 || fseek(bin, 0, SEEK_END))
+			return false;
+		map_size = ftell(bin);
+		void *mem = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, fileno(bin), 0);
+		if(mem == MAP_FAILED)
+			return false;
+		map          = (const char*) mem;
+		chunk_verify = false;
+		set_stride(stride);
+		return true;
+	}
+
+	void set_stride(uint64_t frames){
+		stride = (std::max)(frames, (uint64_t)1);
+		if(!map)
+			return;
+		//Delta frames are decoded from the start of their chunk, so only strides of whole chunks skip pages
+		bool skips = stride > 1 && (info.encoding != ENCODING_DELTA || stride >= chunk_frames);
+		madvise((void*) map, map_size, skips ? MADV_RANDOM : MADV_SEQUENTIAL);
+	}
+
+	void close(){
+		if(map)
+			munmap((void*) map, map_size);
+		codec.release();
+		frame.release();
+		free(record);
+		free(slot_id);
+	}
+
+ private:
+	//Load the index from the end of the file, returning false if there is none
+	bool read_index(){
+		char tag[8];
+		uint64_t index_offset, counts[3];
+		if(fseek(bin, -(long)(sizeof(uint64_t) + sizeof(INDEX_TAG)), SEEK_END)
+			|| 1 != fread(&index_offset, sizeof(uint64_t), 1, bin)
+			|| 1 != fread(tag, sizeof(tag), 1, bin) || memcmp(tag, INDEX_TAG, 8))
+			return false;
+		if(fseek(bin, index_offset, SEEK_SET)
+			|| 1 != fread(tag, sizeof(tag), 1, bin) || memcmp(tag, INDEX_TAG, 8)
+			|| 1 != fread(counts, sizeof(counts), 1, bin) || !counts[1])
+			return false;
+		frame_offset.resize(counts[0]);
+		chunk_offset.resize(counts[2]);
+		chunk_frames = counts[1];
+		return frame_offset.size() == fread(frame_offset.data(), sizeof(uint64_t), frame_offset.size(), bin)
+			&& chunk_offset.size() == fread(chunk_offset.data(), sizeof(uint64_t), chunk_offset.size(), bin)
+			&& (frame_offset.size() + chunk_frames - 1) / chunk_frames == chunk_offset.size();
+	}
+
+	int next_mapped(){
+		if(tick == frame_offset.size())
+			return 1; //Proper EOF
+		const uint64_t offset = frame_offset[tick];
+		const char *p = map + offset;
+		uint64_t count, size;
+		size_t head = sizeof(FRAME_TAG) + sizeof(uint64_t);
+		if(offset + head + sizeof(uint64_t) > map_size || memcmp(p, FRAME_TAG, 8))
+			return 2;
+		memcpy(&count, p + sizeof(FRAME_TAG), sizeof(uint64_t));
+		if(count > info.body_count)
+			return 2;
+		size = frame_record_size(info, count) - head;
+		if(info.encoding == ENCODING_DELTA){
+			uint64_t rest;
+			memcpy(&rest, p + head, sizeof(uint64_t));
+			if(rest > size)
+				return 2;
+			head += sizeof(uint64_t);
+			size  = rest;
+		}
+		if(offset + head + size > map_size)
+			return 2;
+
+		const uint64_t in_chunk = tick % chunk_frames;
+		if(!in_chunk){
+			const ChunkHeader *chunk = (const ChunkHeader*) (map + chunk_offset[tick / chunk_frames]);
+			chunk_sum    = chunk->sum;
+			chunk_hash   = CHECKSUM_SEED;
+			chunk_verify = true;
+		}
+		if(chunk_verify){
+			chunk_hash = checksum(chunk_hash, p, head + size);
+			bool last = in_chunk == chunk_frames - 1 || tick + 1 == frame_offset.size();
+			if(last && chunk_hash != chunk_sum)
+				return 2; //Corrupt chunk
+		}
+
+		frame.count = count;
+		if(!codec.decode(p + head, size, frame))
+			return 2;
+		tick++;
+		if(stride > 1 && tick - 1 + stride < frame_offset.size())
+			prefetch(tick - 1 + stride);
+		return 0;
+	}
+
+	//Ask for the pages needed to read frame target, from its chunk's keyframe if delta encoded
+	void prefetch(uint64_t target){
+		uint64_t begin = info.encoding == ENCODING_DELTA ? chunk_offset[target / chunk_frames] : frame_offset[target];
+		uint64_t end   = target + 1 < frame_offset.size() ? frame_offset[target + 1] : map_size;
+		uint64_t page  = sysconf(_SC_PAGESIZE);
+		begin = begin / page * page;
+		madvise((void*) (map + begin), end - begin, MADV_WILLNEED);
+	}
+
+	//Rebuild the index of a file cut short by walking its complete chunks
+	bool scan_chunks(long offset){
+		frame_offset.clear();
+		chunk_offset.clear();
+		chunk_frames = 0;
+		if(fseek(bin, 0, SEEK_END))
+			return false;
+		uint64_t file_size = ftell(bin);
+		ChunkHeader chunk;
+		while(!fseek(bin, offset, SEEK_SET) && 1 == fread(&chunk, sizeof(ChunkHeader), 1, bin)){
+			if(memcmp(chunk.tag, CHUNK_TAG, 8) || !chunk.frames || offset + sizeof(ChunkHeader) + chunk.bytes > file_size)
+				break; //Unfinished chunk, or the index
+			if(!chunk_frames)
+				chunk_frames = chunk.frames;
+			if(chunk.frames > chunk_frames)
+				break;
+			chunk_offset.push_back(offset);
+			uint64_t frame = offset + sizeof(ChunkHeader);
+			for(uint64_t f = 0; f < chunk.frames; ++f){
+				uint64_t count, rest;
+				frame_offset.push_back(frame);
+				if(fseek(bin, frame + sizeof(FRAME_TAG), SEEK_SET) || 1 != fread(&count, sizeof(uint64_t), 1, bin) || count > info.body_count)
+					return false;
+				if(info.encoding == ENCODING_DELTA){
+					if(1 != fread(&rest, sizeof(uint64_t), 1, bin))
+						return false;
+					frame += sizeof(FRAME_TAG) + 2*sizeof(uint64_t) + rest;
+				} else {
+					frame += frame_record_size(info, count);
+				}
+			}
+			offset += sizeof(ChunkHeader) + chunk.bytes;
+			if(chunk.frames < chunk_frames)
+				break; //Only the last chunk is short
+		}
+		if(!chunk_frames)
+			chunk_frames = chunk_frames_for(info);
+		return true;
+	}
+};
+
+//Doubles per tick of a column, and where they start in a body
+inline size_t column_width(uint64_t dims, int column){
+	return column < COLUMN_POS ? 1 : dims;
+}
+inline size_t column_offset(uint64_t dims, int column){
+	return column < COLUMN_POS ? column : 2 + (column - COLUMN_POS)*dims;
+}
+
+/***
+*
+* Column file layout shared by ColumnWriter and ColumnReader.
+*
+***/
+struct ColumnLayout {
+	HistoryInfo info;
+	uint64_t    ticks_per_block;
+	uint64_t    data_start; //File offset of the first block
+
+	uint64_t block_ticks(uint64_t block){
+		return (std::min)(ticks_per_block, info.tick_count - block*ticks_per_block);
+	}
+	//File offset of tick t (relative to its block) of body id's column, in a block of ticks ticks
+	uint64_t offset(uint64_t block, uint64_t ticks, int column, uint64_t id, uint64_t t){
+		uint64_t bodies = info.body_count + 1;
+		uint64_t w = column_width(info.dims, column);
+		uint64_t doubles = block*ticks_per_block*bodies*info.body_doubles()
+			+ column_offset(info.dims, column)*bodies*ticks
+			+ (id*ticks + t)*w;
+		return data_start + doubles*sizeof(double);
+	}
+};
+
+/***
+*
+* Writes frames to a column file, gathering a block of ticks in memory before
+* writing it out column by column. ticks_per_block is cut down as needed to
+* keep a block within COLUMN_BLOCK_BYTES.
+*
+***/
+struct ColumnWriter {
+	FILE        *bout;
+	ColumnLayout layout;
+	uint64_t     filled; //Ticks gathered in block
+	double      *block;  //Always laid out for a full block
+
+	void open(FILE *out, const HistoryInfo &history, uint64_t ticks_per_block){
+		bout = out;
+		layout.info = history;
+		uint64_t tick_bytes = (history.body_count + 1) * history.body_doubles() * sizeof(double);
+		layout.ticks_per_block = (std::max)((uint64_t)1, (std::min)(ticks_per_block, (uint64_t)(COLUMN_BLOCK_BYTES / tick_bytes)));
+		layout.info.tick_count = 0;
+		filled = 0;
+		block  = (double*) malloc(layout.ticks_per_block * tick_bytes);
+
+		unsigned short s = sizeof(uint64_t);
+		uint64_t ext[] = {3*sizeof(uint64_t), history.dims, layout.ticks_per_block};
+		char dest_buf[32+sizeof(uint64_t)*2+sizeof(ext)];
+		memcpy(&dest_buf[00+s*0], HISTORY_BLURB, 16);
+		memcpy(&dest_buf[16+s*0], &history.body_count, s);
+		memcpy(&dest_buf[16+s*1], &history.tick_count, s);
+		memcpy(&dest_buf[16+s*2], COLUMN_BLURB, 16);
+		memcpy(&dest_buf[32+s*2], ext, sizeof(ext));
+		fwrite(dest_buf, sizeof(char), sizeof(dest_buf), bout);
+		layout.data_start = sizeof(dest_buf);
+	}
+
+	//Add a frame. Versions 1 to 3 mark dead bodies by zeroing them, so pass skip_dead for those
+	void append(HistoryFrame &frame, bool skip_dead = false){
+		const HistoryInfo &info = layout.info;
+		const uint64_t T = layout.ticks_per_block;
+		const size_t bd = info.body_doubles();
+		if(!filled){
+			for(size_t i = 0; i < T*(info.body_count+1)*bd; ++i){
+				block[i] = NAN;
+			}
+		}
+		for(uint64_t i = 0; i <= frame.count; ++i){
+			const double *src = &frame.body[i*bd];
+			uint64_t id = i < frame.count ? frame.id[i] : info.body_count;
+			if(i < frame.count && skip_dead && !src[1])
+				continue;
+			for(int c = 0; c < COLUMN_COUNT; ++c){
+				size_t w = column_width(info.dims, c);
+				double *dst = &block[column_offset(info.dims, c)*(info.body_count+1)*T + (id*T + filled)*w];
+				memcpy(dst, &src[column_offset(info.dims, c)], w*sizeof(double));
+			}
+		}
+		if(++filled == T)
+			flush();
+	}
+
+	void close(){
+		if(filled)
+			flush();
+		fseek(bout, offsetof(HistoryHeader, tick_count), SEEK_SET);
+		fwrite(&layout.info.tick_count, sizeof(uint64_t), 1, bout);
+		fflush(bout);
+		free(block);
+	}
+
+ private:
+	//Write the gathered ticks, packing the column runs down to the ticks actually filled
+	void flush(){
+		const HistoryInfo &info = layout.info;
+		const uint64_t T = layout.ticks_per_block;
+		for(int c = 0; c < COLUMN_COUNT; ++c){
+			size_t w = column_width(info.dims, c);
+			for(uint64_t id = 0; id <= info.body_count; ++id){
+				fwrite(&block[column_offset(info.dims, c)*(info.body_count+1)*T + id*T*w], sizeof(double), filled*w, bout);
+			}
+		}
+		layout.info.tick_count += filled;
+		filled = 0;
+	}
+};
+
+/***
+*
+* Random access reader for column files.
+*
+* open() returns 0 on success, 1 on failure.
+* read() copies column_width() doubles per tick of one column of body id
+* (body_count for the barycenter) for ticks begin to end into out, touching
+* only those bytes. Returns 0 on success, 2 if the range is out of bounds or
+* the file is short.
+*
+***/
+struct ColumnReader {
+	FILE        *bin;
+	ColumnLayout layout;
+
+	int open(FILE *in){
+		bin = in;
+		HistoryHeader head;
+		uint64_t ext[3];
+		if(!bin || 1 != fread(&head, sizeof(HistoryHeader), 1, bin) || 1 != fread(ext, sizeof(ext), 1, bin))
+			return 1;
+		if(memcmp(head.blurb1, HISTORY_BLURB, 16) || memcmp(head.blurb2, COLUMN_BLURB, 16) || ext[0] < sizeof(ext))
+			return 1;
+		layout.info = { };
+		layout.info.body_count = head.body_count;
+		layout.info.tick_count = head.tick_count;
+		layout.info.dims       = ext[1];
+		layout.ticks_per_block = ext[2];
+		layout.data_start      = sizeof(HistoryHeader) + ext[0];
+		if(layout.info.dims < 2 || layout.info.dims > 3 || !layout.ticks_per_block)
+			return 1;
+		return 0;
+	}
+
+	int read(int column, uint64_t id, uint64_t begin, uint64_t end, double *out){
+		const uint64_t T = layout.ticks_per_block;
+		if(column < 0 || column >= COLUMN_COUNT || id > layout.info.body_count || begin > end || end > layout.info.tick_count)
+			return 2;
+		size_t w = column_width(layout.info.dims, column);
+		for(uint64_t tick = begin; tick < end; ){
+			uint64_t block = tick / T;
+			uint64_t first = tick - block*T;
+			uint64_t count = (std::min)(end - tick, layout.block_ticks(block) - first);
+			if(fseek(bin, layout.offset(block, layout.block_ticks(block), column, id, first), SEEK_SET)
+				|| count*w != fread(out, sizeof(double), count*w, bin))
+				return 2;
+			out  += count*w;
+			tick += count;
+		}
+		return 0;
+	}
+};
+
+#endif // HISTORY_H
@@ -0,0 +1,225 @@
+/********************
+*
+* NBODY SIMULATION LIVE STREAM
+*
+*********************/
+
+/***
+*
+* A stream carries frames from a running simulator to a renderer through a
+* POSIX shared memory segment, instead of a history file read afterwards.
+*
+* The segment is a header followed by a ring of slots, each holding one frame
+* as HistoryFrame lays it out: the tick, the body count, the uint32_t ID of
+* each body zero padded to a multiple of 8 bytes, then the bodies followed by
+* the barycenter as doubles.
+*
+* There is one producer and one consumer, and neither ever takes a lock. head
+* counts frames published and is only written by the producer; tail counts
+* frames consumed and is only written by the consumer. The producer fills slot
+* head % slots and then releases head + 1; the consumer reads slot tail % slots
+* once it has acquired a head past it, and then releases tail + 1. When the
+* ring is full the producer either drops the frame (counting it) or waits for
+* the consumer, as the policy it was created with says; it stops waiting once
+* the consumer has detached.
+*
+***/
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include "History.h"
+
+#define STREAM_SLOTS 16 //Default frames in the ring
+
+static const char STREAM_BLURB[16] = {'U','N','I','V','E','R','S','E',' ','S','T','R','E','A','M',' '};
+
+struct StreamHeader {
+	char     blurb[16]; //Set last, once the rest is ready
+	uint64_t body_count;
+	uint64_t dims;
+	uint64_t slots;
+	uint64_t slot_size;
+	uint64_t block;    //Wait for the consumer rather than drop frames when full
+	double   dt;
+	alignas(64) std::atomic<uint64_t> head;     //Frames published
+	std::atomic<uint64_t> closed;   //Producer is done
+	std::atomic<uint64_t> dropped;
+	alignas(64) std::atomic<uint64_t> tail;     //Frames consumed
+	std::atomic<uint64_t> detached; //Consumer is gone
+};
+
+//Spin briefly, then sleep, while waiting on the other side of the ring
+inline void stream_pause(uint64_t &spins){
+	if(++spins < 64){
+		std::this_thread::yield();
+	} else {
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+/***
+*
+* Either end of a stream. create() makes the segment (the producer), attach()
+* maps one a producer made, waiting for it to appear (the consumer). Both
+* return false on failure.
+*
+* Producer: acquire() returns the frame to fill, or nullptr if the ring is
+* full and frames are being dropped, and publish() hands it over.
+* Consumer: next() copies the next frame into frame, which must be allocated
+* for info, and returns 0 on success or 1 once the producer is done and every
+* frame published has been read.
+*
+***/
+struct FrameStream {
+	StreamHeader *head;
+	size_t        size;
+	const char   *name;
+	HistoryInfo   info;
+	HistoryFrame  slot;  //View of the producer's current slot
+	uint64_t      tick;  //Tick of the frame last acquired or read
+
+	bool create(const char *shm_name, const HistoryInfo &history, uint64_t slots, bool block){
+		name = shm_name;
+		info = history;
+		uint64_t slot_size = slot_bytes(info);
+		size = sizeof(StreamHeader) + slots*slot_size;
+		shm_unlink(name);
+		int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+		if(fd < 0)
+			return false;
+		void *mem = ftruncate(fd, size) ? MAP_FAILED : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mem == MAP_FAILED){
+			shm_unlink(name);
+			return false;
+		}
+		head = (StreamHeader*) mem;
+		head->body_count = info.body_count;
+		head->dims       = info.dims;
+		head->slots      = slots;
+		head->slot_size  = slot_size;
+		head->block      = block;
+		head->dt         = info.dt;
+		head->head       = 0;
+		head->closed     = 0;
+		head->dropped    = 0;
+		head->tail       = 0;
+		head->detached   = 0;
+		std::atomic_thread_fence(std::memory_order_release);
+		memcpy(head->blurb, STREAM_BLURB, sizeof(STREAM_BLURB));
+		tick = 0;
+		return true;
+	}
+
+	bool attach(const char *shm_name){
+		name = shm_name;
+		int fd;
+		while((fd = shm_open(name, O_RDWR, 0)) < 0){
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+		struct stat st;
+		uint64_t spins = 0;
+		while(!fstat(fd, &st) && (size_t) st.st_size < sizeof(StreamHeader)){
+			stream_pause(spins);
+		}
+		size = st.st_size;
+		void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if(mem == MAP_FAILED)
+			return false;
+		head = (StreamHeader*) mem;
+		while(memcmp((const void*) head->blurb, STREAM_BLURB, sizeof(STREAM_BLURB))){
+			stream_pause(spins);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		info = { };
+		info.body_count = head->body_count;
+		info.dims       = head->dims;
+		info.dt         = head->dt;
+		info.version    = HISTORY_VERSION;
+		info.fields     = FIELD_POS | FIELD_VEL | FIELD_ACC | FIELD_MASS;
+		tick = 0;
+		return size >= sizeof(StreamHeader) + head->slots*head->slot_size;
+	}
+
+	HistoryFrame *acquire(uint64_t frame_tick){
+		uint64_t h = head->head.load(std::memory_order_relaxed);
+		uint64_t spins = 0;
+		while(h - head->tail.load(std::memory_order_acquire) == head->slots){
+			if(!head->block || head->detached.load(std::memory_order_relaxed)){
+				head->dropped.fetch_add(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+			stream_pause(spins);
+		}
+		char *p = slot_at(h);
+		memcpy(p, &frame_tick, sizeof(uint64_t));
+		slot.id   = (uint32_t*) (p + 2*sizeof(uint64_t));
+		slot.body = (double*)   (p + 2*sizeof(uint64_t) + pad8(info.body_count*sizeof(uint32_t)));
+		slot.row  = nullptr;
+		tick = frame_tick;
+		return &slot;
+	}
+
+	void publish(){
+		uint64_t h = head->head.load(std::memory_order_relaxed);
+		memcpy(slot_at(h) + sizeof(uint64_t), &slot.count, sizeof(uint64_t));
+		head->head.store(h + 1, std::memory_order_release);
+	}
+
+	int next(HistoryFrame &frame){
+		uint64_t t = head->tail.load(std::memory_order_relaxed);
+		uint64_t spins = 0;
+		while(head->head.load(std::memory_order_acquire) == t){
+			if(head->closed.load(std::memory_order_acquire) && head->head.load(std::memory_order_acquire) == t)
+				return 1; //Producer is done
+			stream_pause(spins);
+		}
+		const char *p = slot_at(t);
+		uint64_t count;
+		memcpy(&tick, p, sizeof(uint64_t));
+		memcpy(&count, p + sizeof(uint64_t), sizeof(uint64_t));
+		if(count > info.body_count)
+			count = info.body_count;
+		p += 2*sizeof(uint64_t);
+		memcpy(frame.id, p, count*sizeof(uint32_t));
+		p += pad8(head->body_count*sizeof(uint32_t));
+		memcpy(frame.body, p, (count+1)*info.body_doubles()*sizeof(double));
+		frame.count = count;
+		head->tail.store(t + 1, std::memory_order_release);
+		return 0;
+	}
+
+	uint64_t dropped(){
+		return head->dropped.load(std::memory_order_relaxed);
+	}
+
+	//Producer: mark the stream done and remove its name. Consumer: detach
+	void close(bool producer){
+		if(producer){
+			head->closed.store(1, std::memory_order_release);
+			shm_unlink(name);
+		} else {
+			head->detached.store(1, std::memory_order_relaxed);
+		}
+		munmap(head, size);
+	}
+
+ private:
+	static uint64_t slot_bytes(const HistoryInfo &info){
+		return 2*sizeof(uint64_t) + pad8(info.body_count*sizeof(uint32_t)) + (info.body_count+1)*info.body_doubles()*sizeof(double);
+	}
+	char *slot_at(uint64_t frame){
+		return (char*) head + sizeof(StreamHeader) + (frame % head->slots)*head->slot_size;
+	}
+};
+
+#endif
@@ -21,6 +21,7 @@
 //    distribution.
 //
 // Modified for log4cplus, copyright (c) 2014-2015 Václav Zeman.
+// Modified to record task, queue wait and barrier wait traces.
 
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
@@ -37,10 +38,43 @@
 #include <stdexcept>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
 
 
 namespace progschj {
 
+// one span of time spent by a thread, in nanoseconds since tracing started
+struct TraceEvent
+{
+    const char * name;
+    std::uint64_t begin;
+    std::uint64_t end;
+    std::uint64_t queued; // time the task spent in the queue, 0 for waits
+};
+
+// events recorded by one thread, which is the only one writing them;
+// once full, further events are counted and dropped
+struct TraceBuffer
+{
+    std::unique_ptr<TraceEvent[]> events;
+    std::atomic<std::size_t> count;
+    std::size_t dropped;
+
+    void record(const char * name, std::uint64_t begin, std::uint64_t end,
+        std::uint64_t queued, std::size_t capacity)
+    {
+        std::size_t n = count.load(std::memory_order_relaxed);
+        if (n == capacity)
+        {
+            ++dropped;
+            return;
+        }
+        events[n] = TraceEvent{name, begin, end, queued};
+        count.store(n + 1, std::memory_order_release);
+    }
+};
+
 class ThreadPool {
 public:
     explicit ThreadPool(std::size_t threads
@@ -52,17 +86,32 @@ public:
     void wait_until_nothing_in_flight();
     void set_queue_size_limit(std::size_t limit);
     void set_pool_size(std::size_t limit);
+    // record up to events_per_thread spans for each worker, and one more
+    // buffer for the thread enqueueing and waiting on the pool
+    void start_trace(std::size_t events_per_thread);
+    // name given to the tasks enqueued from now on
+    void trace_label(const char * label);
+    // write the trace as Chrome trace JSON, returns the events dropped
+    std::size_t write_trace(std::FILE * out);
     ~ThreadPool();
 
 private:
     void emplace_back_worker (std::size_t worker_number);
+    std::uint64_t trace_now() const;
+
+    struct queued_task
+    {
+        std::function<void()> run;
+        const char * label;
+        std::uint64_t enqueued;
+    };
 
     // need to keep track of threads so we can join them
     std::vector< std::thread > workers;
     // target pool size
     std::size_t pool_size;
     // the task queue
-    std::queue< std::function<void()> > tasks;
+    std::queue< queued_task > tasks;
     // queue length limit
     std::size_t max_queue_size = 100000;
     // stop signal
@@ -77,6 +126,14 @@ private:
     std::condition_variable in_flight_condition;
     std::atomic<std::size_t> in_flight;
 
+    // tracing, one buffer per worker number and the last for the producer
+    std::atomic<TraceBuffer *> trace{nullptr};
+    std::unique_ptr<TraceBuffer[]> trace_buffers;
+    std::size_t trace_threads = 0;
+    std::size_t trace_capacity = 0;
+    const char * current_label = "task";
+    std::chrono::steady_clock::time_point trace_epoch;
+
     struct handle_in_flight_decrement
     {
         ThreadPool & tp;
@@ -136,7 +193,8 @@ auto ThreadPool::enqueue(F&& f, Args&&... args)
     if (stop)
         throw std::runtime_error("enqueue on stopped ThreadPool");
 
-    tasks.emplace([task](){ (*task)(); });
+    tasks.push(queued_task{[task](){ (*task)(); }, current_label,
+        trace.load(std::memory_order_relaxed) ? trace_now() : 0});
     std::atomic_fetch_add_explicit(&in_flight,
         std::size_t(1),
         std::memory_order_relaxed);
@@ -160,16 +218,97 @@ inline ThreadPool::~ThreadPool()
 
 inline void ThreadPool::wait_until_empty()
 {
-    std::unique_lock<std::mutex> lock(this->queue_mutex);
-    this->condition_producers.wait(lock,
-        [this]{ return this->tasks.empty(); });
+    TraceBuffer * buffers = trace.load(std::memory_order_acquire);
+    std::uint64_t begin = buffers ? trace_now() : 0;
+    {
+        std::unique_lock<std::mutex> lock(this->queue_mutex);
+        this->condition_producers.wait(lock,
+            [this]{ return this->tasks.empty(); });
+    }
+    if (buffers)
+        buffers[trace_threads - 1].record("wait until empty", begin,
+            trace_now(), 0, trace_capacity);
 }
 
 inline void ThreadPool::wait_until_nothing_in_flight()
 {
-    std::unique_lock<std::mutex> lock(this->in_flight_mutex);
-    this->in_flight_condition.wait(lock,
-        [this]{ return this->in_flight == 0; });
+    TraceBuffer * buffers = trace.load(std::memory_order_acquire);
+    std::uint64_t begin = buffers ? trace_now() : 0;
+    {
+        std::unique_lock<std::mutex> lock(this->in_flight_mutex);
+        this->in_flight_condition.wait(lock,
+            [this]{ return this->in_flight == 0; });
+    }
+    if (buffers)
+        buffers[trace_threads - 1].record("wait until nothing in flight",
+            begin, trace_now(), 0, trace_capacity);
+}
+
+inline std::uint64_t ThreadPool::trace_now() const
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+inline void ThreadPool::start_trace(std::size_t events_per_thread)
+{
+    std::unique_lock<std::mutex> lock(this->queue_mutex);
+
+    if (stop || trace.load(std::memory_order_relaxed))
+        return;
+
+    trace_threads = (std::max)(pool_size, workers.size()) + 1;
+    trace_capacity = (std::max)(events_per_thread, std::size_t(1));
+    trace_buffers.reset(new TraceBuffer[trace_threads]);
+    for (std::size_t i = 0; i != trace_threads; ++i)
+    {
+        trace_buffers[i].events.reset(new TraceEvent[trace_capacity]);
+        trace_buffers[i].count = 0;
+        trace_buffers[i].dropped = 0;
+    }
+    trace_epoch = std::chrono::steady_clock::now();
+    trace.store(trace_buffers.get(), std::memory_order_release);
+}
+
+inline void ThreadPool::trace_label(const char * label)
+{
+    std::unique_lock<std::mutex> lock(this->queue_mutex);
+    current_label = label;
+}
+
+// complete ("X") events in microseconds, one track per thread; the pool
+// should be idle, as only events already recorded are written
+inline std::size_t ThreadPool::write_trace(std::FILE * out)
+{
+    TraceBuffer * buffers = trace.load(std::memory_order_acquire);
+    std::size_t dropped = 0;
+    std::fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (std::size_t t = 0; buffers && t != trace_threads; ++t)
+    {
+        bool producer = t + 1 == trace_threads;
+        std::fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\","
+            "\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s %zu\"}}",
+            first ? "" : ",\n", t, producer ? "producer" : "worker",
+            producer ? std::size_t(0) : t);
+        first = false;
+        std::size_t n = buffers[t].count.load(std::memory_order_acquire);
+        for (std::size_t i = 0; i != n; ++i)
+        {
+            TraceEvent const & e = buffers[t].events[i];
+            std::fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"%s\","
+                "\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,"
+                "\"dur\":%.3f", e.name, e.queued ? "task" : "wait", t,
+                e.begin / 1e3, (e.end - e.begin) / 1e3);
+            if (e.queued)
+                std::fprintf(out, ",\"args\":{\"queued_us\":%.3f}",
+                    e.queued / 1e3);
+            std::fprintf(out, "}");
+        }
+        dropped += buffers[t].dropped;
+    }
+    std::fprintf(out, "\n]}\n");
+    return dropped;
 }
 
 inline void ThreadPool::set_queue_size_limit(std::size_t limit)
@@ -215,8 +354,13 @@ inline void ThreadPool::emplace_back_worker (std::size_t worker_number)
         {
             for(;;)
             {
-                std::function<void()> task;
+                queued_task task;
                 bool notify;
+                TraceBuffer * buffers = this->trace.load(
+                    std::memory_order_acquire);
+                if (buffers && worker_number + 1 >= this->trace_threads)
+                    buffers = nullptr; // started after tracing began
+                std::uint64_t wait_begin = buffers ? this->trace_now() : 0;
 
                 {
                     std::unique_lock<std::mutex> lock(this->queue_mutex);
@@ -262,7 +406,20 @@ inline void ThreadPool::emplace_back_worker (std::size_t worker_number)
                     condition_producers.notify_all();
                 }
 
-                task();
+                if (!buffers)
+                {
+                    task.run();
+                    continue;
+                }
+
+                std::uint64_t begin = this->trace_now();
+                TraceBuffer & buffer = buffers[worker_number];
+                buffer.record("queue wait", wait_begin, begin, 0,
+                    this->trace_capacity);
+                task.run();
+                buffer.record(task.label, begin, this->trace_now(),
+                    (std::max)(begin - task.enqueued, std::uint64_t(1)),
+                    this->trace_capacity);
             }
         }
         );
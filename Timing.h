@@ -0,0 +1,171 @@
+/********************
+*
+* NBODY SIMULATION PHASE TIMING
+*
+*********************/
+
+/***
+*
+* Times the phases of each tick of the simulation loop and keeps a histogram
+* of each, so a slow run shows where its ticks go.
+*
+* The loop calls start() as a tick begins, mark(phase) as each phase ends, and
+* end_tick() once the tick is over. A mark charges the time since the previous
+* mark (or the start) to its phase, so each phase costs one read of the steady
+* clock, and a phase skipped on some tick is simply not marked.
+*
+* Histograms are log-linear: exact below 8ns, then 8 buckets to each power of
+* two, so percentiles are good to 1/16 of their value. min, max and the total
+* are exact. dump() prints count, min, p50, p99, max and the share of the tick
+* for every phase; poll() dumps to stderr if SIGUSR1 arrived since the last
+* poll, so a long run can be looked at without stopping it.
+*
+* Timing is only compiled in with -DPHASE_TIMING. Without it PhaseTimer is an
+* empty struct whose calls compile to nothing.
+*
+***/
+
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#define PHASE_SUB_BUCKETS 8 //Buckets to each power of two
+#define PHASE_BUCKETS     (64*PHASE_SUB_BUCKETS)
+
+#ifdef PHASE_TIMING
+
+struct PhaseHistogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t bucket[PHASE_BUCKETS];
+
+	void add(uint64_t ns){
+		bucket[index(ns)]++;
+		min = count ? (std::min)(min, ns) : ns;
+		max = (std::max)(max, ns);
+		sum += ns;
+		count++;
+	}
+
+	//Value below which a fraction q of the samples fall, as the middle of its bucket
+	uint64_t percentile(double q) const {
+		if(!count)
+			return 0;
+		uint64_t rank = (uint64_t)(q * (count - 1)) + 1;
+		uint64_t seen = 0;
+		size_t i = 0;
+		while((seen += bucket[i]) < rank){
+			i++;
+		}
+		uint64_t value = lower(i) + width(i)/2;
+		return (std::max)(min, (std::min)(max, value));
+	}
+
+ private:
+	static size_t index(uint64_t ns){
+		if(ns < PHASE_SUB_BUCKETS)
+			return ns;
+		int k = 63 - __builtin_clzll(ns); //At least 3
+		return (k - 2)*PHASE_SUB_BUCKETS + ((ns >> (k - 3)) & (PHASE_SUB_BUCKETS - 1));
+	}
+	static uint64_t lower(size_t i){
+		if(i < PHASE_SUB_BUCKETS)
+			return i;
+		int k = i/PHASE_SUB_BUCKETS + 2;
+		return (PHASE_SUB_BUCKETS + i%PHASE_SUB_BUCKETS) << (k - 3);
+	}
+	static uint64_t width(size_t i){
+		return i < PHASE_SUB_BUCKETS ? 1 : 1ull << (i/PHASE_SUB_BUCKETS - 1);
+	}
+};
+
+static volatile sig_atomic_t phase_dump_requested = 0;
+
+inline void phase_dump_signal(int){
+	phase_dump_requested = 1;
+}
+
+/***
+*
+* names holds count phase names and must outlive the timer. The tick as a
+* whole is kept as one more histogram after the phases.
+*
+***/
+struct PhaseTimer {
+	const char *const *names;
+	size_t          count;
+	PhaseHistogram *hist;
+	std::chrono::steady_clock::time_point tick_start;
+	std::chrono::steady_clock::time_point last;
+
+	void open(const char *const phase_names[], size_t phase_count){
+		names = phase_names;
+		count = phase_count;
+		hist  = (PhaseHistogram*) calloc(count + 1, sizeof(PhaseHistogram));
+		signal(SIGUSR1, phase_dump_signal);
+	}
+
+	void start(){
+		tick_start = last = std::chrono::steady_clock::now();
+	}
+
+	void mark(size_t phase){
+		auto now = std::chrono::steady_clock::now();
+		hist[phase].add(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+		last = now;
+	}
+
+	void end_tick(){
+		hist[count].add(std::chrono::duration_cast<std::chrono::nanoseconds>(last - tick_start).count());
+	}
+
+	void poll(){
+		if(phase_dump_requested){
+			phase_dump_requested = 0;
+			dump(stderr);
+		}
+	}
+
+	void dump(FILE *out) const {
+		double tick_total = (std::max)(hist[count].sum, (uint64_t)1);
+		fprintf(out, "\n%-16s %10s %10s %10s %10s %10s %10s %7s\n", "Phase (us)", "count", "min", "p50", "p99", "max", "total", "share");
+		for(size_t i = 0; i <= count; ++i){
+			const PhaseHistogram &h = hist[i];
+			if(!h.count)
+				continue;
+			fprintf(out, "%-16s %10lu %10.1f %10.1f %10.1f %10.1f %10.0f %6.1f%%\n", i < count ? names[i] : "tick", (unsigned long) h.count,
+				h.min/1e3, h.percentile(0.5)/1e3, h.percentile(0.99)/1e3, h.max/1e3, h.sum/1e3, 100.0*h.sum/tick_total);
+		}
+		fflush(out);
+	}
+
+	void close(){
+		signal(SIGUSR1, SIG_DFL);
+		free(hist);
+	}
+};
+
+#else
+
+struct PhaseTimer {
+	void open(const char *const *, size_t){}
+	void start(){}
+	void mark(size_t){}
+	void end_tick(){}
+	void poll(){}
+	void dump(FILE *) const {}
+	void close(){}
+};
+
+#endif
+
+#endif
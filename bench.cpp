@@ -0,0 +1,419 @@
+/********************
+*
+* NBODY SIMULATION BENCHMARKS
+*
+*********************/
+
+/*
+g++ bench.cpp -o bench -O2 -Wall -std=c++17 -pthread -funroll-loops
+./bench [--suites=force,collide,serialize,write,pool] [--bodies=100,1000,10000] [--threads=1,<CORES>]
+	[--engines=<FILTER>] [--densities=0.01,0.1,1] [--frames=<N>] [--tasks=<N>] [--history=<FILE>]
+	[--seed=<N>] [--min-time=<SECONDS>] [--min-reps=<N>] [--out=<FILE>]
+	(--engines keeps the force engines whose name, like 3d/float/plummer/symmetric, contains FILTER)
+	(results are JSON, one benchmark per line, to --out or stdout; progress goes to stderr)
+*/
+
+/***
+*
+* Times the pieces of the simulation on their own, built from the same code as
+* nbodyV3, which is included here with its main() left out.
+*
+*	force     - One force pass of every engine through the thread pool, as the
+*	            tick loop runs it, per unique pair of bodies (N(N-1)/2 for both
+*	            kernels, so full and symmetric compare directly).
+*	collide   - collide_universe with a fraction of the bodies flagged, half of
+*	            those placed on top of another so they merge, per flagged pair.
+*	serialize - fill_frame, per body.
+*	write     - Frames through HistoryWriter to a file in each encoding,
+*	            including the final sync, per frame.
+*	pool      - Empty tasks through the thread pool, per task.
+*
+* Every universe comes from create_universe with the given seed, so runs on
+* different builds time the same work. Each benchmark runs once untimed, then
+* repeats until it has taken min-reps repetitions and min-time seconds; the
+* minimum, median and mean of the repetitions are reported, and the per unit
+* figures use the median.
+*
+***/
+
+#define NBODY_NO_MAIN
+#include "mainV3.cpp"
+
+#include <vector>
+#include <algorithm>
+
+#define BENCH_BODIES	 "100,1000,10000"
+#define BENCH_DENSITIES	 "0.01,0.1,1"
+#define BENCH_SEED	 1
+#define BENCH_MIN_TIME	 0.2
+#define BENCH_MIN_REPS	 3
+#define BENCH_MAX_REPS	 1000
+#define BENCH_FRAMES	 64    //Frames per repetition of the write benchmark
+#define BENCH_TASKS	 10000 //Tasks per repetition of the pool benchmark
+
+struct Sample {
+	uint   reps;
+	double min;
+	double median;
+	double mean;
+};
+
+//Parse a comma separated list of numbers
+template<typename T>
+std::vector<T> parse_list(const char *list){
+	std::vector<T> values;
+	std::stringstream in(list);
+	std::string item;
+	while(std::getline(in, item, ',')){
+		if(!item.empty())
+			values.push_back((T) std::stod(item));
+	}
+	return values;
+}
+
+struct Bench {
+	FILE  *out;
+	bool   first;
+	uint   seed;
+	double min_time;
+	uint   min_reps;
+	uint   frames;
+	uint   tasks;
+	const char *engines;
+	const char *history;
+	std::vector<uint>   bodies;
+	std::vector<uint>   threads;
+	std::vector<double> densities;
+
+	/***
+	*
+	* Time run() until there are enough repetitions, calling setup() untimed
+	* before each one.
+	*
+	***/
+	template<class Setup, class Run>
+	Sample measure(Setup setup, Run run){
+		std::vector<double> times;
+		double total = 0;
+		setup();
+		run(); //Warm up
+		while(times.size() < BENCH_MAX_REPS && (times.size() < min_reps || total < min_time)){
+			setup();
+			auto start = std::chrono::steady_clock::now();
+			run();
+			double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			times.push_back(time);
+			total += time;
+		}
+		std::sort(times.begin(), times.end());
+		return {times.size(), times.front(), times[times.size()/2], total / times.size()};
+	}
+
+	//One result line. units is how many of unit one repetition does, bytes how much it writes if anything
+	void emit(const char *bench, const std::string &variant, uint body_count, uint thread_count, const Sample &s, const char *unit, double units, uint bytes = 0){
+		fprintf(out, "%s{\"bench\":\"%s\",\"variant\":\"%s\",\"bodies\":%lu,\"threads\":%lu,\"reps\":%lu,"
+			"\"min_s\":%.9g,\"median_s\":%.9g,\"mean_s\":%.9g,\"unit\":\"%s\",\"units\":%.17g,\"ns_per_unit\":%.6g,\"units_per_s\":%.6g",
+			first ? "" : ",\n", bench, variant.c_str(), body_count, thread_count, s.reps,
+			s.min, s.median, s.mean, unit, units, s.median / units * 1e9, units / s.median);
+		if(bytes)
+			fprintf(out, ",\"bytes\":%lu,\"mb_per_s\":%.6g", bytes, bytes / 1e6 / s.median);
+		fprintf(out, "}");
+		fflush(out);
+		first = false;
+		fprintf(stderr, "%-9s %-28s N=%-7lu T=%-3lu %10.4g ns/%s", bench, variant.c_str(), body_count, thread_count, s.median / units * 1e9, unit);
+		if(bytes)
+			fprintf(stderr, " %8.1f MB/s", bytes / 1e6 / s.median);
+		fprintf(stderr, " (%lu reps)\n", s.reps);
+	}
+};
+
+/***
+*
+* A universe of n bodies as nbodyV3 would create it with seed, with the
+* predicted positions the force pass reads filled in.
+*
+***/
+template<class E>
+void bench_universe(Universe<E> &universe, Body<E> &barycenter, uint n, uint bands, uint seed, const Params &p){
+	char name[] = "bench", history[] = "-", mean[] = "1.0", stddev[] = "0.5", ticks[] = "1", inclination[] = "--inclination=30";
+	char *argv[] = {name, history, mean, stddev, ticks, inclination, nullptr};
+	std::default_random_engine rng(seed);
+	universe = { };
+	barycenter = { };
+	universe.allocate(n, bands);
+	create_universe(universe, rng, 6, argv);
+	update_barycenter(barycenter, universe);
+	for(uint i = 0; i < universe.len; ++i){
+		universe.body[i].calc_pos(p);
+	}
+}
+
+template<class E>
+std::string engine_name(){
+	return std::to_string(E::dims) + "d/" + (sizeof(typename E::real) == sizeof(double) ? "double" : "float") + "/"
+		+ E::softening::name + "/" + (E::symmetric ? "symmetric" : "full");
+}
+
+//Dimensions and precision, all that the benchmarks other than force depend on
+template<class E>
+std::string state_name(){
+	return std::to_string(E::dims) + "d/" + (sizeof(typename E::real) == sizeof(double) ? "double" : "float");
+}
+
+template<class E>
+void bench_force(Bench &b, const Params &p){
+	std::string name = engine_name<E>();
+	if(b.engines && name.find(b.engines) == std::string::npos)
+		return;
+	for(uint t : b.threads){
+		progschj::ThreadPool pool(t);
+		for(uint n : b.bodies){
+			Universe<E> universe;
+			Body<E> barycenter;
+			bench_universe(universe, barycenter, n, t, b.seed, p);
+			Sample s = b.measure([&]{
+				for(uint i = 0; i < universe.len; ++i){
+					universe.body[i].force   = { };
+					universe.body[i].collide = false;
+				}
+			}, [&]{
+				if(E::symmetric){
+					split_bands(universe);
+					for(uint band = 0; band < universe.bands; ++band){
+						pool.enqueue([band, &universe, &p]{
+							calc_force_band(universe, band, p);
+						});
+					}
+				} else {
+					for(uint i = 0; i < universe.len; ++i){
+						pool.enqueue([i, &universe, &p]{
+							universe.body[i].calc_force(universe, i, p);
+						});
+					}
+				}
+				pool.wait_until_empty();
+				pool.wait_until_nothing_in_flight();
+				if(E::symmetric){
+					for(uint i = 0; i < universe.len; ++i){
+						gather_force(universe, i);
+					}
+				}
+			});
+			b.emit("force", name, n, t, s, "pair", (double) n*(n-1)/2);
+			universe.release();
+		}
+	}
+}
+
+template<class E>
+void bench_collide(Bench &b, const Params &p){
+	std::string name = state_name<E>();
+	for(uint n : b.bodies){
+		Universe<E> universe, original, base;
+		Body<E> barycenter;
+		bench_universe(base, barycenter, n, 0, b.seed, p);
+		universe.allocate(n, 0);
+		original.allocate(n, 0);
+		for(double density : b.densities){
+			//Flag every step-th body, and move every other flagged body onto the one before it
+			uint flagged = (std::max)((std::min)((uint)(density*n), n), (uint)1);
+			uint step = n / flagged;
+			memcpy(original.body, base.body, n*sizeof(Body<E>));
+			memcpy(original.id, base.id, n*sizeof(uint32_t));
+			original.len = base.len;
+			for(uint i = 0, k = 0; i < n && k < flagged; i += step, ++k){
+				original.body[i].collide = true;
+				if(k % 2)
+					original.body[i].pos = original.body[i - step].pos;
+			}
+			Sample s = b.measure([&]{
+				memcpy(universe.body, original.body, n*sizeof(Body<E>));
+				memcpy(universe.id, original.id, n*sizeof(uint32_t));
+				universe.len = original.len;
+			}, [&]{
+				collide_universe(universe);
+			});
+			char variant[64];
+			snprintf(variant, sizeof(variant), "%s/%g", name.c_str(), density);
+			b.emit("collide", variant, n, 1, s, "pair", flagged > 1 ? (double) flagged*(flagged-1)/2 : 1.0);
+		}
+		universe.release();
+		original.release();
+		base.release();
+	}
+}
+
+template<class E>
+HistoryInfo bench_info(uint n, uint ticks, uint64_t encoding, const Params &p){
+	HistoryInfo info = { };
+	info.body_count = n;
+	info.tick_count = ticks;
+	info.dims       = E::dims;
+	info.encoding   = encoding;
+	info.fields     = FIELD_POS | FIELD_MASS;
+	info.bits       = QUANT_BITS;
+	info.dt         = p.dt;
+	info.keyframe   = KEYFRAME;
+	return info;
+}
+
+template<class E>
+void bench_serialize(Bench &b, const Params &p){
+	std::string name = state_name<E>();
+	for(uint n : b.bodies){
+		Universe<E> universe;
+		Body<E> barycenter;
+		bench_universe(universe, barycenter, n, 0, b.seed, p);
+		HistoryInfo info = bench_info<E>(n, 1, ENCODING_FULL, p);
+		HistoryFrame frame;
+		frame.allocate(info);
+		Sample s = b.measure([]{ }, [&]{
+			fill_frame(barycenter, universe, frame);
+		});
+		b.emit("serialize", name, n, 1, s, "body", n);
+		frame.release();
+		universe.release();
+	}
+}
+
+template<class E>
+void bench_write(Bench &b, const Params &p){
+	static const char *ENCODING_NAMES[] = {"full", "compact", "delta"};
+	std::string name = state_name<E>();
+	for(uint n : b.bodies){
+		Universe<E> universe;
+		Body<E> barycenter;
+		bench_universe(universe, barycenter, n, 0, b.seed, p);
+		for(uint64_t encoding : {ENCODING_FULL, ENCODING_COMPACT, ENCODING_DELTA}){
+			HistoryInfo info = bench_info<E>(n, b.frames, encoding, p);
+			uint bytes = 0;
+			Sample s = b.measure([]{ }, [&]{
+				FILE *bout = fopen(b.history, "w+b");
+				HistoryWriter writer;
+				if(!bout || !writer.open(bout, info, WRITE_BUFFERS, CODEC_THREADS, 0, OUTPUT_STDIO)){
+					fprintf(stderr, "Could not write %s!\n", b.history);
+					exit(EXIT_FAILURE);
+				}
+				for(uint f = 0; f < b.frames; ++f){
+					write_bin_frame(barycenter, universe, writer);
+					for(uint i = 0; i < universe.len; ++i){
+						universe.body[i].pos += universe.body[i].vel * typename E::real(p.dt); //Drift, so delta frames differ
+					}
+				}
+				writer.close();
+				bytes = writer.bytes_written();
+				fclose(bout);
+			});
+			remove(b.history);
+			b.emit("write", name + "/" + ENCODING_NAMES[encoding], n, CODEC_THREADS, s, "frame", b.frames, bytes);
+		}
+		universe.release();
+	}
+}
+
+void bench_pool(Bench &b){
+	for(uint t : b.threads){
+		progschj::ThreadPool pool(t);
+		std::atomic<uint> done(0);
+		Sample s = b.measure([]{ }, [&]{
+			for(uint i = 0; i < b.tasks; ++i){
+				pool.enqueue([&done]{
+					done.fetch_add(1, std::memory_order_relaxed);
+				});
+			}
+			pool.wait_until_empty();
+			pool.wait_until_nothing_in_flight();
+		});
+		b.emit("pool", "empty task", 0, t, s, "task", b.tasks);
+	}
+}
+
+int main(int argc, char *argv[]){
+	Params p;
+	p.dt      = DELTA_TIME;
+	p.grav    = GRAV_CONST;
+	p.epsilon = EPSILON;
+	p.dt_half    = p.dt * 0.5;
+	p.dt_sq_half = p.dt * p.dt * 0.5;
+
+	size_t cores = (std::max)(1u, std::thread::hardware_concurrency());
+	Bench b;
+	b.first     = true;
+	b.seed      = get_opt(argc, argv, "seed")     ? std::stoull(get_opt(argc, argv, "seed"))     : BENCH_SEED;
+	b.min_time  = get_opt(argc, argv, "min-time") ? std::stod(get_opt(argc, argv, "min-time"))   : BENCH_MIN_TIME;
+	b.min_reps  = get_opt(argc, argv, "min-reps") ? std::stoull(get_opt(argc, argv, "min-reps")) : BENCH_MIN_REPS;
+	b.frames    = get_opt(argc, argv, "frames")   ? std::stoull(get_opt(argc, argv, "frames"))   : BENCH_FRAMES;
+	b.tasks     = get_opt(argc, argv, "tasks")    ? std::stoull(get_opt(argc, argv, "tasks"))    : BENCH_TASKS;
+	b.engines   = get_opt(argc, argv, "engines");
+	b.history   = get_opt(argc, argv, "history")  ? get_opt(argc, argv, "history") : "bench.history";
+	b.bodies    = parse_list<uint>(get_opt(argc, argv, "bodies") ? get_opt(argc, argv, "bodies") : BENCH_BODIES);
+	b.densities = parse_list<double>(get_opt(argc, argv, "densities") ? get_opt(argc, argv, "densities") : BENCH_DENSITIES);
+	if(get_opt(argc, argv, "threads")){
+		b.threads = parse_list<uint>(get_opt(argc, argv, "threads"));
+	} else {
+		b.threads.push_back(1);
+		if(cores > 1)
+			b.threads.push_back(cores);
+	}
+	std::string suites = get_opt(argc, argv, "suites") ? get_opt(argc, argv, "suites") : "force,collide,serialize,write,pool";
+	auto wanted = [&suites](const char *suite){ return ("," + suites + ",").find(std::string(",") + suite + ",") != std::string::npos; };
+	for(uint n : b.bodies){
+		if(n < 2){
+			fprintf(stderr, "Body counts must be at least 2!\n");
+			return EXIT_FAILURE;
+		}
+	}
+	for(uint t : b.threads){
+		if(t < 1){
+			fprintf(stderr, "Thread counts must be at least 1!\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	const char *out_path = get_opt(argc, argv, "out");
+	b.out = out_path ? fopen(out_path, "w") : stdout;
+	if(!b.out){
+		fprintf(stderr, "Could not open %s!\n", out_path);
+		return EXIT_FAILURE;
+	}
+	fprintf(b.out, "{\"seed\":%lu,\"min_time\":%g,\"min_reps\":%lu,\"cores\":%lu,\"compiler\":\"%s\",\"results\":[\n",
+		b.seed, b.min_time, b.min_reps, cores, __VERSION__);
+
+	if(wanted("force")){
+		bench_force<Engine<2, double, PaddedSoftening,  false>>(b, p);
+		bench_force<Engine<2, double, PaddedSoftening,  true >>(b, p);
+		bench_force<Engine<2, double, PlummerSoftening, false>>(b, p);
+		bench_force<Engine<2, double, PlummerSoftening, true >>(b, p);
+		bench_force<Engine<2, float,  PaddedSoftening,  false>>(b, p);
+		bench_force<Engine<2, float,  PaddedSoftening,  true >>(b, p);
+		bench_force<Engine<2, float,  PlummerSoftening, false>>(b, p);
+		bench_force<Engine<2, float,  PlummerSoftening, true >>(b, p);
+		bench_force<Engine<3, double, PaddedSoftening,  false>>(b, p);
+		bench_force<Engine<3, double, PaddedSoftening,  true >>(b, p);
+		bench_force<Engine<3, double, PlummerSoftening, false>>(b, p);
+		bench_force<Engine<3, double, PlummerSoftening, true >>(b, p);
+		bench_force<Engine<3, float,  PaddedSoftening,  false>>(b, p);
+		bench_force<Engine<3, float,  PaddedSoftening,  true >>(b, p);
+		bench_force<Engine<3, float,  PlummerSoftening, false>>(b, p);
+		bench_force<Engine<3, float,  PlummerSoftening, true >>(b, p);
+	}
+	if(wanted("collide")){
+		bench_collide<Engine<2, double, PaddedSoftening, false>>(b, p);
+		bench_collide<Engine<3, double, PaddedSoftening, false>>(b, p);
+	}
+	if(wanted("serialize")){
+		bench_serialize<Engine<2, double, PaddedSoftening, false>>(b, p);
+		bench_serialize<Engine<3, double, PaddedSoftening, false>>(b, p);
+	}
+	if(wanted("write")){
+		bench_write<Engine<2, double, PaddedSoftening, false>>(b, p);
+		bench_write<Engine<3, double, PaddedSoftening, false>>(b, p);
+	}
+	if(wanted("pool"))
+		bench_pool(b);
+
+	fprintf(b.out, "\n]}\n");
+	if(out_path)
+		fclose(b.out);
+	return EXIT_SUCCESS;
+}
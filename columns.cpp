@@ -0,0 +1,140 @@
+/********************
+*
+* HISTORY COLUMN CONVERTER
+*
+*********************/
+
+/*
+g++ columns.cpp -o columns -O2 -Wall -std=c++17 -pthread
+./columns <HISTORY FILE> <COLUMN FILE> [--ticks-per-block=<N>]
+./columns <COLUMN FILE> --body=<ID>|barycenter --field=mass|radius|pos|vel|acc [--from=<TICK>] [--to=<TICK>]
+*/
+
+#include <math.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "History.h"
+
+#define uint uint64_t
+
+static const char *COLUMN_NAMES[] = {"mass", "radius", "pos", "vel", "acc"};
+
+/***
+*
+* Look up an optional "--name" or "--name=value" argument.
+*
+* Returns the value, an empty string for a bare flag, or nullptr if absent.
+*
+***/
+const char *get_opt(int argc, char *argv[], const char *name){
+	size_t len = strlen(name);
+	for(int i = 1; i < argc; ++i){
+		const char *arg = argv[i];
+		if(strncmp(arg, "--", 2) || strncmp(arg+2, name, len))
+			continue;
+		if(arg[2+len] == '\0')
+			return arg+2+len;
+		if(arg[2+len] == '=')
+			return arg+3+len;
+	}
+	return nullptr;
+}
+
+/***
+*
+* Rewrite a history of any version as a column file.
+*
+***/
+int convert(int argc, char *argv[]){
+	FILE *bin  = fopen(argv[1], "rb");
+	HistoryReader reader;
+	if(reader.open(bin)){
+		std::cerr << "Could not read header!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	FILE *bout = fopen(argv[2], "wb");
+	if(!bout){
+		std::cerr << "Could not open " << argv[2] << "!" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	uint ticks_per_block = get_opt(argc, argv, "ticks-per-block") ? std::stoull(get_opt(argc, argv, "ticks-per-block")) : COLUMN_TICKS;
+	ColumnWriter writer;
+	writer.open(bout, reader.info, ticks_per_block);
+
+	int status;
+	while(!(status = reader.next_frame())){
+		writer.append(reader.frame, reader.info.version < 4);
+	}
+	writer.close();
+	fclose(bout);
+	reader.close();
+
+	if(status == 2){
+		std::cerr << "Malformed frame after tick " << writer.layout.info.tick_count << "!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	printf("Wrote %lu ticks in blocks of %lu\n", writer.layout.info.tick_count, writer.layout.ticks_per_block);
+	return EXIT_SUCCESS;
+}
+
+/***
+*
+* Print one field of one body as CSV rows of the tick and its components.
+*
+***/
+int extract(int argc, char *argv[]){
+	FILE *bin = fopen(argv[1], "rb");
+	ColumnReader reader;
+	if(reader.open(bin)){
+		std::cerr << "Not a column file!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	HistoryInfo &info = reader.layout.info;
+
+	const char *body  = get_opt(argc, argv, "body");
+	const char *field = get_opt(argc, argv, "field");
+	int column = -1;
+	for(int c = 0; field && c < COLUMN_COUNT; ++c){
+		if(!strcmp(field, COLUMN_NAMES[c]))
+			column = c;
+	}
+	if(!body || column < 0){
+		std::cerr << "Need --body=<ID>|barycenter and --field=mass|radius|pos|vel|acc!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	uint id   = strcmp(body, "barycenter") ? std::stoull(body) : info.body_count;
+	uint from = get_opt(argc, argv, "from") ? std::stoull(get_opt(argc, argv, "from")) : 0;
+	uint to   = get_opt(argc, argv, "to")   ? std::stoull(get_opt(argc, argv, "to"))   : info.tick_count;
+	to = (std::min)(to, info.tick_count);
+
+	size_t w = column_width(info.dims, column);
+	double *values = (double*) malloc((to > from ? to - from : 1) * w * sizeof(double));
+	if(reader.read(column, id, from, to, values)){
+		std::cerr << "Could not read ticks " << from << " to " << to << " of body " << id << "!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	for(uint t = from; t < to; ++t){
+		printf("%lu", t);
+		for(size_t k = 0; k < w; ++k){
+			printf(",%.17g", values[(t-from)*w + k]);
+		}
+		printf("\n");
+	}
+	free(values);
+	fclose(bin);
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]){
+	if(argc > 2 && strncmp(argv[2], "--", 2))
+		return convert(argc, argv);
+	if(argc > 1)
+		return extract(argc, argv);
+	std::cerr << "Usage: columns <HISTORY FILE> <COLUMN FILE> | columns <COLUMN FILE> --body=<ID> --field=<FIELD>" << std::endl;
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,377 @@
+/********************
+*
+* HISTORY EXPORTER
+*
+*********************/
+
+/*
+g++ export.cpp -o export -O2 -Wall -std=c++17 -pthread
+./export <HISTORY FILE> <OUTPUT FILE> [--format=csv|columns] [--bodies=all|<ID>,<FIRST>-<LAST>,barycenter]
+	[--fields=mass,radius,pos,vel,acc] [--from=<TICK>] [--to=<TICK>] [--stride=<N>] [--threads=<N>]
+	(column output renumbers the bodies selected from 0, in the order given, and leaves unselected fields NaN)
+*/
+
+#include <math.h>
+#include <iostream>
+#include <string>
+#include <charconv>
+#include <cstring>
+#include <vector>
+#include <thread>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "ThreadPool.h"
+#include "History.h"
+
+#define uint uint64_t
+#define EXPORT_BATCH 64 //Frames formatted on the pool while the next batch is read
+
+static const char *COLUMN_NAMES[]  = {"mass", "radius", "pos", "vel", "acc"};
+static const char *COLUMN_TITLES[] = {"Mass", "Radius", "Position", "Velocity", "Acceleration"};
+static const char AXIS_NAMES[] = "XYZ";
+
+/***
+*
+* Look up an optional "--name" or "--name=value" argument.
+*
+* Returns the value, an empty string for a bare flag, or nullptr if absent.
+*
+***/
+const char *get_opt(int argc, char *argv[], const char *name){
+	size_t len = strlen(name);
+	for(int i = 1; i < argc; ++i){
+		const char *arg = argv[i];
+		if(strncmp(arg, "--", 2) || strncmp(arg+2, name, len))
+			continue;
+		if(arg[2+len] == '\0')
+			return arg+2+len;
+		if(arg[2+len] == '=')
+			return arg+3+len;
+	}
+	return nullptr;
+}
+
+/***
+*
+* Parse "all", or a comma separated list of body IDs, ranges of them such as
+* "10-20" and "barycenter", into IDs (body_count for the barycenter).
+*
+* Returns false if any item is not a body of the history.
+*
+***/
+bool parse_bodies(const char *list, uint body_count, std::vector<uint> &ids){
+	ids.clear();
+	if(!strcmp(list, "all")){
+		for(uint i = 0; i <= body_count; ++i)
+			ids.push_back(i);
+		return true;
+	}
+	while(*list){
+		const char *end = strchr(list, ',');
+		std::string item(list, end ? end - list : strlen(list));
+		if(item == "barycenter"){
+			ids.push_back(body_count);
+		} else {
+			size_t dash = item.find('-');
+			char *stop;
+			uint first = strtoull(item.c_str(), &stop, 10);
+			uint last  = dash == std::string::npos ? first : strtoull(item.c_str() + dash + 1, &stop, 10);
+			if(*stop || item.empty() || first > last || last >= body_count)
+				return false;
+			for(uint i = first; i <= last; ++i)
+				ids.push_back(i);
+		}
+		list += item.size() + (end ? 1 : 0);
+	}
+	return !ids.empty();
+}
+
+//Columns selected by a comma separated list of their names, or an empty list if any is unknown
+std::vector<int> parse_columns(const char *list){
+	std::vector<int> columns;
+	while(*list){
+		const char *end = strchr(list, ',');
+		size_t len = end ? end - list : strlen(list);
+		int column = -1;
+		for(int c = 0; c < COLUMN_COUNT; ++c){
+			if(strlen(COLUMN_NAMES[c]) == len && !strncmp(list, COLUMN_NAMES[c], len))
+				column = c;
+		}
+		if(column < 0)
+			return { };
+		columns.push_back(column);
+		list += len + (end ? 1 : 0);
+	}
+	return columns;
+}
+
+/***
+*
+* Frames of the history, with what the exporter made of each: its CSV row,
+* or the frame of the selected bodies for a column file.
+*
+***/
+struct Batch {
+	HistoryFrame frame[EXPORT_BATCH];
+	HistoryFrame picked[EXPORT_BATCH];
+	uint         tick[EXPORT_BATCH];
+	char        *row[EXPORT_BATCH];
+	size_t       row_len[EXPORT_BATCH];
+	size_t       count;
+};
+
+struct Exporter {
+	HistoryReader     reader;
+	HistoryInfo       picked_info; //Info of the column file written
+	std::vector<uint> ids;
+	std::vector<int>  columns;
+	bool     csv;
+	uint     tick;   //Next tick to export
+	uint     to;
+	uint     stride;
+	size_t   row_bytes;
+
+	void allocate(Batch &batch){
+		for(size_t f = 0; f < EXPORT_BATCH; ++f){
+			batch.frame[f].allocate(reader.info);
+			if(csv){
+				batch.row[f] = (char*) malloc(row_bytes);
+			} else {
+				batch.picked[f].allocate(picked_info);
+			}
+		}
+	}
+	void release(Batch &batch){
+		for(size_t f = 0; f < EXPORT_BATCH; ++f){
+			batch.frame[f].release();
+			if(csv){
+				free(batch.row[f]);
+			} else {
+				batch.picked[f].release();
+			}
+		}
+	}
+
+	//Read the next frames due into batch. Returns 2 on a malformed history, otherwise 0
+	int read(Batch &batch){
+		const HistoryInfo &info = reader.info;
+		batch.count = 0;
+		while(batch.count < EXPORT_BATCH && tick < to){
+			int status = 0;
+			if(info.version >= 6){
+				if(reader.tick != tick && reader.seek(tick))
+					return 2;
+			} else {
+				while(reader.tick < tick && !status)
+					status = reader.next_frame(); //Older histories are read through to the ticks wanted
+			}
+			if(!status)
+				status = reader.next_frame();
+			if(status == 1){
+				to = tick;
+				break;
+			}
+			if(status)
+				return 2;
+			HistoryFrame &dst = batch.frame[batch.count];
+			dst.count = reader.frame.count;
+			memcpy(dst.id, reader.frame.id, dst.count*sizeof(uint32_t));
+			memcpy(dst.body, reader.frame.body, (dst.count+1)*info.body_doubles()*sizeof(double));
+			batch.tick[batch.count++] = tick;
+			tick += stride;
+		}
+		return 0;
+	}
+
+	//Values of body id in frame, after index_rows(), or nullptr if it is not live
+	const double *find(HistoryFrame &frame, uint id){
+		const HistoryInfo &info = reader.info;
+		if(id == info.body_count)
+			return frame.barycenter(info);
+		uint i = frame.row[id];
+		if(i >= frame.count || frame.id[i] != id)
+			return nullptr;
+		const double *src = &frame.body[i*info.body_doubles()];
+		if(info.version < 4 && !src[1])
+			return nullptr; //Versions 1 to 3 keep dead bodies as zeroed slots
+		return src;
+	}
+
+	void format(Batch &batch, size_t f){
+		const HistoryInfo &info = reader.info;
+		HistoryFrame &frame = batch.frame[f];
+		frame.index_rows();
+		char *p = batch.row[f];
+		p = std::to_chars(p, p + 24, batch.tick[f]).ptr;
+		for(uint id : ids){
+			const double *src = find(frame, id);
+			for(int c : columns){
+				size_t w = column_width(info.dims, c);
+				for(size_t k = 0; k < w; ++k){
+					*p++ = ',';
+					if(src)
+						p = std::to_chars(p, p + 32, src[column_offset(info.dims, c) + k]).ptr;
+				}
+			}
+		}
+		*p++ = '\n';
+		batch.row_len[f] = p - batch.row[f];
+	}
+
+	//Gather the selected bodies, renumbered in the order selected, and fields of a frame
+	void pick(Batch &batch, size_t f){
+		const HistoryInfo &info = reader.info;
+		HistoryFrame &frame = batch.frame[f];
+		HistoryFrame &out   = batch.picked[f];
+		const size_t bd = info.body_doubles();
+		frame.index_rows();
+		auto copy = [this, &info, bd](const double *src, double *dst){
+			for(size_t k = 0; k < bd; ++k)
+				dst[k] = NAN;
+			for(int c : columns)
+				memcpy(&dst[column_offset(info.dims, c)], &src[column_offset(info.dims, c)], column_width(info.dims, c)*sizeof(double));
+		};
+		out.count = 0;
+		const double *bary = nullptr;
+		uint next_id = 0;
+		for(uint id : ids){
+			const double *src = find(frame, id);
+			if(id == info.body_count){
+				bary = src;
+				continue;
+			}
+			if(src){
+				out.id[out.count] = next_id;
+				copy(src, &out.body[out.count++*bd]);
+			}
+			next_id++;
+		}
+		double *dst = out.barycenter(picked_info);
+		if(bary){
+			copy(bary, dst);
+		} else {
+			for(size_t k = 0; k < bd; ++k)
+				dst[k] = NAN;
+		}
+	}
+};
+
+int main(int argc, char *argv[]){
+	if(argc < 3 || !strncmp(argv[2], "--", 2)){
+		std::cerr << "Usage: export <HISTORY FILE> <OUTPUT FILE> [--format=csv|columns] [--bodies=<LIST>] [--fields=<LIST>] [--from=<TICK>] [--to=<TICK>] [--stride=<N>] [--threads=<N>]" << std::endl;
+		return EXIT_FAILURE;
+	}
+	size_t threads = get_opt(argc, argv, "threads") ? std::stoull(get_opt(argc, argv, "threads")) : (std::max)(2u, std::thread::hardware_concurrency());
+	threads = (std::max)(threads, (size_t)1);
+
+	Exporter ex;
+	FILE *bin = fopen(argv[1], "rb");
+	if(ex.reader.open(bin, threads)){
+		std::cerr << "Could not read header!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	const HistoryInfo &info = ex.reader.info;
+
+	const char *format = get_opt(argc, argv, "format");
+	ex.csv = !format || !strcmp(format, "csv");
+	if(!ex.csv && strcmp(format, "columns")){
+		std::cerr << "Unknown format \"" << format << "\", expected csv or columns!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if(!parse_bodies(get_opt(argc, argv, "bodies") ? get_opt(argc, argv, "bodies") : "all", info.body_count, ex.ids)){
+		std::cerr << "Bodies must be all, or a list of IDs below " << info.body_count << ", ranges of them and barycenter!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	ex.columns = parse_columns(get_opt(argc, argv, "fields") ? get_opt(argc, argv, "fields") : "pos");
+	if(ex.columns.empty()){
+		std::cerr << "Fields must be a list of mass, radius, pos, vel and acc!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	uint from  = get_opt(argc, argv, "from")   ? std::stoull(get_opt(argc, argv, "from"))   : 0;
+	ex.to      = get_opt(argc, argv, "to")     ? std::stoull(get_opt(argc, argv, "to"))     : info.tick_count;
+	ex.stride  = get_opt(argc, argv, "stride") ? (std::max)(1ull, std::stoull(get_opt(argc, argv, "stride"))) : 1;
+	ex.tick    = from;
+	ex.to      = (std::min)(ex.to, info.tick_count);
+
+	//Chunked histories are read through a memory map, seeking straight to the ticks exported
+	ex.reader.map_file();
+	ex.reader.set_stride(ex.stride);
+
+	FILE *bout = fopen(argv[2], "wb");
+	if(!bout){
+		std::cerr << "Could not open " << argv[2] << "!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	ColumnWriter columns;
+	if(ex.csv){
+		ex.row_bytes = 32;
+		std::string header = "Tick";
+		for(uint id : ex.ids){
+			std::string body = id == info.body_count ? "Barycenter" : "Body " + std::to_string(id);
+			for(int c : ex.columns){
+				size_t w = column_width(info.dims, c);
+				for(size_t k = 0; k < w; ++k){
+					header += ',' + body + ' ';
+					if(w > 1)
+						header += std::string(1, AXIS_NAMES[k]) + ' ';
+					header += COLUMN_TITLES[c];
+				}
+				ex.row_bytes += w*33;
+			}
+		}
+		header += '\n';
+		fwrite(header.data(), 1, header.size(), bout);
+	} else {
+		ex.picked_info = info;
+		ex.picked_info.body_count = 0;
+		for(uint id : ex.ids)
+			ex.picked_info.body_count += id != info.body_count;
+		ex.picked_info.tick_count = ex.to > from ? (ex.to - from + ex.stride - 1) / ex.stride : 0;
+		columns.open(bout, ex.picked_info, COLUMN_TICKS);
+	}
+
+	progschj::ThreadPool pool(threads);
+	Batch *batch = new Batch[2];
+	ex.allocate(batch[0]);
+	ex.allocate(batch[1]);
+	int status = ex.read(batch[0]);
+	uint exported = 0;
+	for(int cur = 0; !status && batch[cur].count; cur ^= 1){
+		Batch &b = batch[cur];
+		for(size_t f = 0; f < b.count; ++f){
+			pool.enqueue([&ex, &b, f]{
+				if(ex.csv){
+					ex.format(b, f);
+				} else {
+					ex.pick(b, f);
+				}
+			});
+		}
+		status = ex.read(batch[cur ^ 1]); //Read on while the pool works
+		pool.wait_until_empty();
+		pool.wait_until_nothing_in_flight();
+		for(size_t f = 0; f < b.count; ++f){
+			if(ex.csv){
+				fwrite(b.row[f], 1, b.row_len[f], bout);
+			} else {
+				columns.append(b.picked[f]);
+			}
+		}
+		exported += b.count;
+	}
+	if(!ex.csv)
+		columns.close();
+	fclose(bout);
+	ex.release(batch[0]);
+	ex.release(batch[1]);
+	delete[] batch;
+	ex.reader.close();
+
+	if(status == 2){
+		std::cerr << "Malformed frame before tick " << ex.tick << "!" << std::endl;
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "Exported %lu ticks of %lu bodies\n", exported, ex.ids.size());
+	return EXIT_SUCCESS;
+}
@@ -6,7 +6,22 @@
 
 /*
 g++ mainV3.cpp -o nbodyV3 -O2 -Wall -std=c++17 -pthread -funroll-loops
-./nbodyV3 <FILE TO SAVE HISTORY IN> 1.0 0.5 36120
+	(add -march=native to let the padded 3D vectors use 256-bit AVX registers)
+./nbodyV3 <FILE TO SAVE HISTORY IN> 1.0 0.5 36120 [--bodies=<N>] [--csv]
+	[--precision=double|float] [--softening=padded|plummer] [--kernel=full|symmetric]
+	[--dt=<DT>] [--grav=<G>] [--epsilon=<EPS>] [--dims=2|3] [--inclination=<DEGREES>]
+	[--write-buffers=<N>] [--encoding=full|compact|delta] [--fields=pos,vel,acc,mass] [--bits=16|32]
+	[--keyframe=<N>] [--codec-threads=<N>] [--layout=chunks|columns] [--seed=<N>]
+	[--checkpoint=<FILE>] [--checkpoint-every=<N>] [--checkpoint-mode=fork|sync] [--resume=<FILE>]
+	[--stream=<SHM NAME>] [--stream-slots=<N>] [--stream-policy=drop|block] [--output=stdio|mmap|uring]
+	[--progress-every=<SECONDS>] [--progress-json=<FILE>] [--trace=<FILE>] [--trace-events=<N>]
+	[--counters]
+	(--trace writes the pool's tasks and waits as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev)
+	(--counters reads cycles, instructions, LLC misses and packed FP instructions per pair interaction with perf_event_open)
+	(build with -DPHASE_TIMING to time each phase of the tick, dumped at exit and on SIGUSR1)
+	(resume with the same arguments plus --resume; it appends to the history and keeps checkpointing to FILE)
+	(a history file of - only streams, for render --stream=<SHM NAME>)
+	(progress is reported every SECONDS; --progress-json also appends it to FILE as JSON lines, - for stderr)
 */
 
 #include <math.h>
@@ -14,19 +29,41 @@ g++ mainV3.cpp -o nbodyV3 -O2 -Wall -std=c++17 -pthread -funroll-loops
 #include <string>
 #include <chrono>
 #include <random>
+#include <sstream>
+#include <charconv>
 #include <cstring>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "ThreadPool.h"
+#include "History.h"
+#include "Stream.h"
+#include "Timing.h"
+#include "Counters.h"
 
 #define uint uint64_t
-#define BODY_COUNT	 1000
-#define DELTA_TIME	 0.01
-#define DT_SQ_HALF	 (DELTA_TIME * DELTA_TIME * 0.5)
-#define DT_HALF		 (DELTA_TIME * 0.5)
-#define GRAV_CONST	 1
-#define DIMENSIONS	 2
-#define SERIAL_BODY_SIZE (((__SIZEOF_DOUBLE__ * DIMENSIONS) * 3) + (2 * __SIZEOF_DOUBLE__))
+#define BODY_COUNT	 1000  //Default body count, override with --bodies=<N>
+#define DELTA_TIME	 0.01  //Default time step, override with --dt=<DT>
+#define GRAV_CONST	 1     //Default gravitational constant, override with --grav=<G>
+#define EPSILON		 0.001 //Default softening epsilon, override with --epsilon=<EPS>
+#define DIMENSIONS	 2     //Default dimensions, override with --dims=<2|3>
+#define SERIAL_BODY_SIZE(dims) (((__SIZEOF_DOUBLE__ * (dims)) * 3) + (2 * __SIZEOF_DOUBLE__))
+
+#define CACHE_LINE_SIZE	 64
+#define HUGE_PAGE_SIZE	 (2 << 20)
+#define WRITE_BUFFERS	 4 //Default number of history writer buffers, override with --write-buffers=<N>
+#define QUANT_BITS	 16 //Default compact encoding quantisation bits, override with --bits=<16|32>
+#define KEYFRAME	 64 //Default delta encoding keyframe interval, override with --keyframe=<N>
+#define CODEC_THREADS	 2  //Default compact and delta encoding pool size, override with --codec-threads=<N>
+#define CHECKPOINT_EVERY 1024 //Default ticks between checkpoints, override with --checkpoint-every=<N>
+#define CSV_BLOCK_BYTES	 (8 << 20) //CSV output is written in blocks of this many bytes
+#define PROGRESS_EVERY	 0.5 //Default seconds between progress reports, override with --progress-every=<SECONDS>
+#define TRACE_EVENTS	 (1 << 20) //Default pool trace events kept per thread, override with --trace-events=<N>
 
 #ifndef PI
 #define PI (3.14159265358979323846)
@@ -45,81 +82,201 @@ std::string dtos(double x){
 	return out;
 }
 
-struct UnivIdx {
-	size_t arr[BODY_COUNT];
-	size_t len;
+/***
+*
+* Allocate zeroed storage aligned to a cache line. Allocations big enough to
+* span a huge page are aligned to one and have transparent huge pages requested,
+* which cuts TLB misses when sweeping large particle arrays.
+*
+* Exits on allocation failure.
+*
+***/
+void *alloc_aligned(size_t bytes){
+	size_t align = bytes >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : CACHE_LINE_SIZE;
+	bytes = (bytes + align - 1) / align * align;
+	void *ptr = aligned_alloc(align, bytes);
+	if(!ptr){
+		fprintf(stderr, "Could not allocate %lu bytes!\n", bytes);
+		exit(EXIT_FAILURE);
+	}
+	#ifdef MADV_HUGEPAGE
+	if(align == HUGE_PAGE_SIZE)
+		madvise(ptr, bytes, MADV_HUGEPAGE);
+	#endif
+	std::memset(ptr, 0, bytes);
+	return ptr;
+}
+
+/***
+*
+* Look up an optional "--name" or "--name=value" argument.
+*
+* Returns the value, an empty string for a bare flag, or nullptr if absent.
+*
+***/
+const char *get_opt(int argc, char *argv[], const char *name){
+	size_t len = strlen(name);
+	for(int i = 1; i < argc; ++i){
+		const char *arg = argv[i];
+		if(strncmp(arg, "--", 2) || strncmp(arg+2, name, len))
+			continue;
+		if(arg[2+len] == '\0')
+			return arg+2+len;
+		if(arg[2+len] == '=')
+			return arg+3+len;
+	}
+	return nullptr;
+}
+
+/***
+*
+* Run-time physical constants. The kernels take these by value, so they sit in
+* registers for the duration of a pass just as the old macro constants did.
+*
+***/
+struct Params {
+	double dt;
+	double dt_half;
+	double dt_sq_half;
+	double grav;
+	double epsilon;
+};
+
+/***
+*
+* Force softening policies. divisor() returns the |r|^3 the pairwise force is
+* divided by, with eps keeping close encounters from flinging bodies away at
+* ludicrous speed.
+*
+***/
+struct PaddedSoftening {
+	static constexpr const char *name = "padded";
+	template<typename T>
+	static T divisor(T dist_sq, T dist, T eps){
+		return (dist_sq*dist) + eps; //|r|^3 + eps
+	}
+};
+struct PlummerSoftening {
+	static constexpr const char *name = "plummer";
+	template<typename T>
+	static T divisor(T dist_sq, T /*dist*/, T eps){
+		T soft_sq = dist_sq + eps*eps;
+		return soft_sq * sqrt(soft_sq); //(|r|^2 + eps^2)^1.5
+	}
+};
+
+/***
+*
+* Compile-time configuration of the engine. main() instantiates the simulator
+* once per supported combination and picks one from the command line, so the
+* hot loops are specialised as if these were still macros.
+*
+*	DIMS      - Number of spatial dimensions
+*	Real      - Floating point type of the simulation state
+*	Softening - Force softening policy
+*	SYMMETRIC - Evaluate each pair once and apply it to both bodies, rather
+*	            than having every body sum the force from all of the others
+*
+***/
+template<int DIMS, typename Real, class Softening, bool SYMMETRIC>
+struct Engine {
+	static constexpr int  dims      = DIMS;
+	static constexpr bool symmetric = SYMMETRIC;
+	using real      = Real;
+	using softening = Softening;
 };
 
-struct Vector {
-	double x;
-	double y;
-	Vector operator+= (const Vector &obj){
-		x+=obj.x;
-		y+=obj.y;
+/***
+*
+* DIMS-component vector, stored in WIDTH lanes. Three dimensional vectors are
+* padded to four lanes and aligned to their size, so every arithmetic operation
+* is a whole-register SIMD operation rather than three scalar ones. The padding
+* lane starts at zero and every operation keeps it there.
+*
+***/
+template<int DIMS, typename T>
+struct alignas(sizeof(T) * (DIMS == 3 ? 4 : DIMS)) Vec {
+	using scalar = T;
+	static constexpr int WIDTH = DIMS == 3 ? 4 : DIMS;
+	T v[WIDTH];
+	
+	T &operator[] (int i){
+		return v[i];
+	}
+	const T &operator[] (int i) const {
+		return v[i];
+	}
+	Vec operator+= (const Vec &obj){
+		for(int i = 0; i < WIDTH; ++i)
+			v[i]+=obj.v[i];
 		return *this;
 	}
-	Vector operator-= (const Vector &obj){
-		x-=obj.x;
-		y-=obj.y;
+	Vec operator-= (const Vec &obj){
+		for(int i = 0; i < WIDTH; ++i)
+			v[i]-=obj.v[i];
 		return *this;
 	}
-	Vector operator*= (double scalar){
-		x*=scalar;
-		y*=scalar;
+	Vec operator*= (T scalar){
+		for(int i = 0; i < WIDTH; ++i)
+			v[i]*=scalar;
 		return *this;
 	}
-	Vector operator/= (double scalar){
-		x/=scalar;
-		y/=scalar;
+	Vec operator/= (T scalar){
+		for(int i = 0; i < WIDTH; ++i)
+			v[i]/=scalar;
 		return *this;
 	}
+	T norm_sq() const {
+		T out = 0;
+		for(int i = 0; i < WIDTH; ++i)
+			out += v[i]*v[i];
+		return out;
+	}
 	std::string to_string(){
-		return dtos(x) + ',' + dtos(y);
+		std::string out = dtos(v[0]);
+		for(int i = 1; i < DIMS; ++i)
+			out += ',' + dtos(v[i]);
+		return out;
 	}
 };
 
-Vector operator+ (const Vector &lhs, const Vector &rhs){
-	Vector out = {
-		lhs.x+rhs.x,
-		lhs.y+rhs.y
-	};
-	return out;
+template<int DIMS, typename T>
+Vec<DIMS,T> operator+ (const Vec<DIMS,T> &lhs, const Vec<DIMS,T> &rhs){
+	Vec<DIMS,T> out = lhs;
+	return out += rhs;
 }
-Vector operator- (const Vector &lhs, const Vector &rhs){
-	Vector out = {
-		lhs.x-rhs.x,
-		lhs.y-rhs.y
-	};
-	return out;
+template<int DIMS, typename T>
+Vec<DIMS,T> operator- (const Vec<DIMS,T> &lhs, const Vec<DIMS,T> &rhs){
+	Vec<DIMS,T> out = lhs;
+	return out -= rhs;
 }
-Vector operator* (const Vector &lhs, double rhs){
-	Vector out = {
-		lhs.x*rhs,
-		lhs.y*rhs
-	};
-	return out;
+template<int DIMS, typename T>
+Vec<DIMS,T> operator* (const Vec<DIMS,T> &lhs, typename Vec<DIMS,T>::scalar rhs){
+	Vec<DIMS,T> out = lhs;
+	return out *= rhs;
 }
-Vector operator/ (const Vector &lhs, double rhs){
-	Vector out = {
-		lhs.x/rhs,
-		lhs.y/rhs
-	};
-	return out;
+template<int DIMS, typename T>
+Vec<DIMS,T> operator/ (const Vec<DIMS,T> &lhs, typename Vec<DIMS,T>::scalar rhs){
+	Vec<DIMS,T> out = lhs;
+	return out /= rhs;
 }
-Vector operator* (double lhs, const Vector &rhs){
+template<int DIMS, typename T>
+Vec<DIMS,T> operator* (typename Vec<DIMS,T>::scalar lhs, const Vec<DIMS,T> &rhs){
 	return rhs*lhs;
 }
-Vector operator/ (double lhs, const Vector &rhs){
+template<int DIMS, typename T>
+Vec<DIMS,T> operator/ (typename Vec<DIMS,T>::scalar lhs, const Vec<DIMS,T> &rhs){
 	return rhs/lhs;
 }
 
+template<typename T>
 struct Mass {
  private:
-	double value;
-	double inverse;
-	double radius;
+	T value;
+	T inverse;
+	T radius;
  public:
-	void set(double new_mass){
+	void set(T new_mass){
 		value = new_mass;
 		radius = sqrt(new_mass)*.25;
 		if(value == 0){
@@ -128,21 +285,26 @@ struct Mass {
 			inverse = 1/value;
 		}
 	}
-	double get(){
+	T get() const {
 		return value;
 	}
-	double inv(){
+	T inv() const {
 		return inverse;
 	}
-	double rad(){
+	T rad() const {
 		return radius;
 	}
 };
-struct UnivIdx;
+
+template<class E> struct Universe;
+template<class E>
 struct Body {
+	using real   = typename E::real;
+	using Vector = Vec<E::dims, real>;
+	
 	bool   alive;
 	bool   collide;
-	Mass   mass;
+	Mass<real> mass;
 	Vector pos;
 	Vector vel;
 	Vector acc;
@@ -151,78 +313,225 @@ struct Body {
 	Vector new_acc;
 	Vector force;
 	
-	void calc_pos(){
-		new_pos = pos + (vel*DELTA_TIME) + (acc*DT_SQ_HALF);
+	void calc_pos(const Params &p){
+		new_pos = pos + (vel*real(p.dt)) + (acc*real(p.dt_sq_half));
 	}
-	void calc_force(Body (&universe)[BODY_COUNT], uint idx, UnivIdx &univ_idx){
-		for(uint i = 0; i < univ_idx.len; ++i){
-			if(i == idx)
-				continue;
-			Body &other = universe[univ_idx.arr[i]];
-			if(!other.alive)
-				continue; //Skip particle if it isn't "alive"
-			
-			Vector disp = new_pos - other.new_pos; //Displacement vector
-			double dist_sq = disp.x * disp.x + disp.y * disp.y;
-			double dist = sqrt(dist_sq); //Displacement scalar (distance between bodies)
-			double padded_divisor = (dist_sq*dist) + 0.001; //Add an epsilon to prevent bodies that get too close from flinging eachother away at ludicrous speed
-			double scalar_force = -GRAV_CONST * mass.get() * other.mass.get() / padded_divisor; //Note: if you muliply dist by scalar_force, you get the force vector
-			
-			//disp is now used as the force vector, despite the name.
-			disp*=scalar_force;
-			
-			force += disp;
-			
-			if((other.mass.rad()+mass.rad()) > dist){
-				collide = true;
-			}
-		}
+	
+	/***
+	*
+	* Force exerted on this body by other, evaluated at the predicted positions.
+	* Sets touching if the two bodies overlap.
+	*
+	***/
+	Vector pair_force(const Body &other, real grav, real eps, bool &touching) const {
+		Vector disp = new_pos - other.new_pos; //Displacement vector
+		real dist_sq = disp.norm_sq();
+		real dist = sqrt(dist_sq); //Displacement scalar (distance between bodies)
+		real divisor = E::softening::divisor(dist_sq, dist, eps);
+		real scalar_force = -grav * mass.get() * other.mass.get() / divisor; //Note: if you muliply dist by scalar_force, you get the force vector
+		
+		touching = (other.mass.rad()+mass.rad()) > dist;
+		
+		//disp is now used as the force vector, despite the name.
+		return disp*=scalar_force;
 	}
+	void calc_force(Universe<E> &universe, uint idx, const Params &p);
 	void calc_acc(){
 		new_acc = force * mass.inv();
 	}
-	void calc_vel(){
-		new_vel = vel + (acc + new_acc)*DT_HALF;
+	void calc_vel(const Params &p){
+		new_vel = vel + (acc + new_acc)*real(p.dt_half);
 	}
 	void update(){
 		pos = new_pos;
 		acc = new_acc;
 		vel = new_vel;
-		force = {0,0};
-	}
-	
-	void serialize(char (&dest_buf)[SERIAL_BODY_SIZE]){
-		unsigned short s = sizeof(double);
-		double tmp_m = mass.get();
-		double tmp_r = mass.rad();
-		std::memcpy(&dest_buf[s*0], &tmp_m, s);	//MASS
-		std::memcpy(&dest_buf[s*1], &tmp_r, s);	//RADIUS
-		std::memcpy(&dest_buf[s*2], &pos.x, s);	//POS_X
-		std::memcpy(&dest_buf[s*3], &pos.y, s);	//POS_Y
-		std::memcpy(&dest_buf[s*4], &vel.x, s);	//VEL_X
-		std::memcpy(&dest_buf[s*5], &vel.y, s);	//VEL_Y
-		std::memcpy(&dest_buf[s*6], &acc.x, s);	//ACC_X
-		std::memcpy(&dest_buf[s*7], &acc.y, s);	//ACC_Y
+		force = { };
+	}
+	
+	/***
+	*
+	* Write mass, radius, pos, vel and acc as doubles, whatever the precision of
+	* the simulation, so the history format does not depend on the engine.
+	*
+	***/
+	void serialize(char *dest_buf){
+		double tmp[2 + 3*E::dims];
+		tmp[0] = mass.get();	//MASS
+		tmp[1] = mass.rad();	//RADIUS
+		for(int i = 0; i < E::dims; ++i){
+			tmp[2 + 0*E::dims + i] = pos[i];	//POS
+			tmp[2 + 1*E::dims + i] = vel[i];	//VEL
+			tmp[2 + 2*E::dims + i] = acc[i];	//ACC
+		}
+		std::memcpy(dest_buf, tmp, sizeof(tmp));
 	}
 };
 
-void update_barycenter(Body &barycenter, Body (&universe)[BODY_COUNT], UnivIdx &univ_idx){
+/***
+*
+* Live bodies are kept packed into body[0..len), so every pass over the universe
+* only touches live bodies. Dead bodies are swap-removed, which reorders the
+* array, so the stable ID of each body is kept in id[] and written alongside
+* it in the history frames.
+*
+* The symmetric kernel splits the pairs into bands, each accumulating into its
+* own band_force/band_collide row of body_count entries; band_start[] holds the
+* first body index of each band.
+*
+* All of the arrays are carved out of a single aligned allocation sized for the
+* body count the universe was created with.
+*
+***/
+template<class E>
+struct Universe {
+	using Vector = typename Body<E>::Vector;
+	
+	Body<E> *body;
+	uint32_t *id;
+	size_t  *scratch; //Per-tick working space, body_count entries
+	size_t   body_count;
+	size_t   len;
+	
+	Vector  *band_force;
+	bool    *band_collide;
+	size_t  *band_start;
+	size_t   bands;
+	
+	void allocate(size_t n, size_t n_bands){
+		auto round_up = [](size_t bytes){ return (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE; };
+		if(!E::symmetric)
+			n_bands = 0;
+		size_t body_bytes    = round_up(n * sizeof(Body<E>));
+		size_t id_bytes      = round_up(n * sizeof(uint32_t));
+		size_t scratch_bytes = round_up(n * sizeof(size_t));
+		size_t force_bytes   = round_up(n * n_bands * sizeof(Vector));
+		size_t collide_bytes = round_up(n * n_bands * sizeof(bool));
+		size_t start_bytes   = round_up((n_bands + 1) * sizeof(size_t));
+		char *mem = (char*) alloc_aligned(body_bytes + id_bytes + scratch_bytes + force_bytes + collide_bytes + start_bytes);
+		body         = (Body<E>*)  (mem);
+		id           = (uint32_t*) (mem += body_bytes);
+		scratch      = (size_t*)   (mem += id_bytes);
+		band_force   = (Vector*)   (mem += scratch_bytes);
+		band_collide = (bool*)     (mem += force_bytes);
+		band_start   = (size_t*)   (mem += collide_bytes);
+		body_count = n;
+		len        = 0;
+		bands      = n_bands;
+	}
+	void release(){
+		free(body);
+		body = nullptr;
+	}
+	void remove(size_t idx){
+		--len;
+		body[idx] = body[len];
+		id[idx]   = id[len];
+		body[len] = { };
+	}
+};
+
+template<class E>
+void Body<E>::calc_force(Universe<E> &universe, uint idx, const Params &p){
+	real grav = p.grav;
+	real eps  = p.epsilon;
+	for(uint i = 0; i < universe.len; ++i){
+		if(i == idx)
+			continue;
+		bool touching;
+		force += pair_force(universe.body[i], grav, eps, touching);
+		if(touching){
+			collide = true;
+		}
+	}
+}
+
+/***
+*
+* Symmetric force pass. Row i holds the pairs (i, j>i), so row lengths shrink
+* along the array; band boundaries are placed so each band gets about the same
+* number of pairs.
+*
+***/
+template<class E>
+void split_bands(Universe<E> &universe){
+	size_t len   = universe.len;
+	size_t pairs = len*(len-1)/2;
+	size_t done  = 0;
+	size_t row   = 0;
+	universe.band_start[0] = 0;
+	for(size_t b = 1; b < universe.bands; ++b){
+		while(row < len && done < pairs*b/universe.bands){
+			done += len-1-row;
+			++row;
+		}
+		universe.band_start[b] = row;
+	}
+	universe.band_start[universe.bands] = len;
+}
+
+template<class E>
+void calc_force_band(Universe<E> &universe, size_t band, const Params &p){
+	using Vector = typename Universe<E>::Vector;
+	using real   = typename E::real;
+	real grav = p.grav;
+	real eps  = p.epsilon;
+	size_t lo = universe.band_start[band];
+	size_t hi = universe.band_start[band+1];
+	size_t len = universe.len;
+	Vector *force   = &universe.band_force[band*universe.body_count];
+	bool   *collide = &universe.band_collide[band*universe.body_count];
+	std::fill(&force[lo], &force[len], Vector{ });
+	std::fill(&collide[lo], &collide[len], false);
+	
+	for(size_t i = lo; i < hi; ++i){
+		Body<E> &a = universe.body[i];
+		Vector force_a = { };
+		bool collide_a = false;
+		for(size_t j = i+1; j < len; ++j){
+			bool touching;
+			Vector f = a.pair_force(universe.body[j], grav, eps, touching);
+			force_a  += f;
+			force[j] -= f;
+			if(touching){
+				collide_a  = true;
+				collide[j] = true;
+			}
+		}
+		force[i]   += force_a;
+		collide[i] |= collide_a;
+	}
+}
+
+//Sum the per-band force and collision results for body idx
+template<class E>
+void gather_force(Universe<E> &universe, size_t idx){
+	Body<E> &b = universe.body[idx];
+	for(size_t band = 0; band < universe.bands && universe.band_start[band] <= idx; ++band){
+		b.force   += universe.band_force[band*universe.body_count + idx];
+		b.collide |= universe.band_collide[band*universe.body_count + idx];
+	}
+}
+
+template<class E>
+void update_barycenter(Body<E> &barycenter, Universe<E> &universe){
+	using real = typename E::real;
 	
 	if(barycenter.mass.get() == 0){
-		double m = 0;
-		for(uint i = 0; i < univ_idx.len; ++i){
-			Body &b = universe[univ_idx.arr[i]];
+		real m = 0;
+		for(uint i = 0; i < universe.len; ++i){
+			Body<E> &b = universe.body[i];
 			m += b.mass.get();
 		}
 		barycenter.mass.set(m);
 	}
 	
-	barycenter.pos = { 0 };
-	barycenter.vel = { 0 };
-	barycenter.acc = { 0 };
-	for(uint i = 0; i < univ_idx.len; ++i){
-		Body &b = universe[univ_idx.arr[i]];
-		double m = b.mass.get();
+	barycenter.pos = { };
+	barycenter.vel = { };
+	barycenter.acc = { };
+	for(uint i = 0; i < universe.len; ++i){
+		Body<E> &b = universe.body[i];
+		real m = b.mass.get();
 		barycenter.pos+=m*b.pos;
 		barycenter.vel+=m*b.vel;
 		barycenter.acc+=m*b.acc;
@@ -232,11 +541,15 @@ void update_barycenter(Body &barycenter, Body (&universe)[BODY_COUNT], UnivIdx &
 	barycenter.acc*=barycenter.mass.inv();
 }
 
-void write_csv_header(){
-	for(uint i = 0; i < BODY_COUNT; ++i){
-		std::cout << "Body " << i << " X Position";
-		std::cout << ',';
-		std::cout << "Body " << i << " Y Position";
+static const char AXIS_NAMES[] = "XYZ";
+
+void write_csv_header(uint body_count, int dims){
+	for(uint i = 0; i < body_count; ++i){
+		for(int d = 0; d < dims; ++d){
+			if(d)
+				std::cout << ',';
+			std::cout << "Body " << i << ' ' << AXIS_NAMES[d] << " Position";
+		}
 		/*
 		std::cout << ',';
 		std::cout << "Body " << i << " X Velocity";
@@ -250,76 +563,446 @@ void write_csv_header(){
 		std::cout << ',';
 		std::cout << ',';
 	}
-	std::cout << "Barycenter X Position (absolute)";
-	std::cout << ',';
-	std::cout << "Barycenter Y Position (absolute)";
-	std::cout << ',';
-	std::cout << "Barycenter X Velocity (absolute)";
-	std::cout << ',';
-	std::cout << "Barycenter Y Velocity (absolute)";
-	std::cout << ',';
-	std::cout << "Barycenter X Acceleration (absolute)";
-	std::cout << ',';
-	std::cout << "Barycenter Y Acceleration (absolute)";
-	std::cout << std::endl;
+	const char *quantities[] = {"Position", "Velocity", "Acceleration"};
+	for(int q = 0; q < 3; ++q){
+		for(int d = 0; d < dims; ++d){
+			if(q || d)
+				std::cout << ',';
+			std::cout << "Barycenter " << AXIS_NAMES[d] << ' ' << quantities[q] << " (absolute)";
+		}
+	}
+	std::cout << '\n';
 }
 
-void write_csv_frame(Body &barycenter, Body (&universe)[BODY_COUNT]){
-	for(uint i = 0; i < BODY_COUNT; ++i){
-		Body &b = universe[i];
-		if(b.alive)
-			std::cout << (b.pos - barycenter.pos).to_string();
-		else
-			std::cout << ",";
-		/*
-		std::cout << ',';
-		std::cout << (b.vel - barycenter.vel).to_string();
-		std::cout << ',';
-		std::cout << (b.acc - barycenter.acc).to_string();
-		*/
-		std::cout << ',';
-		std::cout << ',';
+/***
+*
+* Writes CSV rows in the column layout of write_csv_header(), numbers being
+* the shortest text that reads back as the same value (std::to_chars).
+*
+* format() cuts a row into one piece of body IDs per pool thread and
+* enqueues them; each formats into its own buffer without allocating. The
+* pieces only read positions and IDs, so they may run alongside the
+* position and force passes. Once the pool has drained, and before the
+* positions are updated, gather() appends the row to the output buffer,
+* which goes to stdout whenever it holds CSV_BLOCK_BYTES.
+*
+***/
+template<class E>
+class CsvWriter {
+ public:
+	void open(size_t body_count, size_t threads){
+		bodies      = body_count;
+		pieces      = (std::min)((std::max)(threads, (size_t)1), (std::max)(body_count, (size_t)1));
+		per_piece   = (bodies + pieces - 1) / pieces;
+		piece_bytes = per_piece * body_bytes;
+		piece       = (char*)   malloc(pieces * piece_bytes);
+		piece_len   = (size_t*) calloc(pieces, sizeof(size_t));
+		capacity    = CSV_BLOCK_BYTES + pieces*piece_bytes + 3*body_bytes;
+		out         = (char*)   malloc(capacity);
+		out_len     = 0;
+	}
+	
+	void format(Body<E> &barycenter, Universe<E> &universe, progschj::ThreadPool &pool){
+		size_t *by_id = universe.scratch; //Storage index of each body ID, or len if dead
+		for(uint i = 0; i < universe.body_count; ++i)
+			by_id[i] = universe.len;
+		for(uint i = 0; i < universe.len; ++i)
+			by_id[universe.id[i]] = i;
+		
+		for(size_t k = 0; k < pieces; ++k){
+			pool.enqueue([this, k, &barycenter, &universe]{
+				const size_t *by_id = universe.scratch;
+				char *p = &piece[k*piece_bytes];
+				size_t end = (std::min)(bodies, (k+1)*per_piece);
+				for(size_t i = k*per_piece; i < end; ++i){
+					if(by_id[i] < universe.len){
+						p = put_vector(p, universe.body[by_id[i]].pos - barycenter.pos);
+					} else {
+						for(int d = 1; d < E::dims; ++d)
+							*p++ = ',';
+					}
+					*p++ = ',';
+					*p++ = ',';
+				}
+				piece_len[k] = p - &piece[k*piece_bytes];
+			});
+		}
+		row_barycenter = barycenter;
+	}
+	
+	void gather(){
+		for(size_t k = 0; k < pieces; ++k){
+			memcpy(&out[out_len], &piece[k*piece_bytes], piece_len[k]);
+			out_len += piece_len[k];
+		}
+		char *p = &out[out_len];
+		p = put_vector(p, row_barycenter.pos);
+		*p++ = ',';
+		p = put_vector(p, row_barycenter.vel);
+		*p++ = ',';
+		p = put_vector(p, row_barycenter.acc);
+		*p++ = '\n';
+		out_len = p - out;
+		if(out_len >= CSV_BLOCK_BYTES)
+			flush();
+	}
+	
+	void close(){
+		flush();
+		fflush(stdout);
+		free(piece);
+		free(piece_len);
+		free(out);
+	}
+
+ private:
+	using Vector = typename Body<E>::Vector;
+	static constexpr size_t NUMBER_BYTES = 32; //Longest to_chars() output of a double is 24
+	static constexpr size_t body_bytes   = E::dims*(NUMBER_BYTES + 1) + 2;
+	
+	static char *put_vector(char *p, const Vector &v){
+		for(int d = 0; d < E::dims; ++d){
+			if(d)
+				*p++ = ',';
+			p = std::to_chars(p, p + NUMBER_BYTES, v[d]).ptr;
+		}
+		return p;
+	}
+	
+	void flush(){
+		fwrite(out, 1, out_len, stdout);
+		out_len = 0;
+	}
+	
+	size_t  bodies;
+	size_t  pieces;
+	size_t  per_piece;
+	size_t  piece_bytes;
+	char   *piece;     //Piece buffers, piece_bytes apart
+	size_t *piece_len;
+	char   *out;
+	size_t  out_len;
+	size_t  capacity;
+	Body<E> row_barycenter;
+};
+
+/***
+*
+* Background writer for the history records.
+*
+* The simulation thread snapshots each frame into one of a ring of
+* preallocated slots and commits it. Committed frames are encoded on the
+* codec's pool as soon as they are committed, several frames at once, and
+* delta encoded frames split into blocks that are encoded concurrently, the
+* last block to finish assembling the record. A dedicated I/O thread is the
+* ordered commit stage: it writes each record into the current chunk with a
+* single fwrite, strictly in frame order, or gathers the frame into the
+* current column block. Without a codec pool the I/O thread encodes too.
+*
+* A delta encoded frame stays in the ring until the next frame is written,
+* as that frame is predicted from it. acquire() only blocks, and the time
+* spent blocked is only counted as stall time, when every slot is still in
+* use.
+*
+***/
+class HistoryWriter {
+ public:
+	/***
+	*
+	* Writes the header too. column_ticks is the ticks per block of a column
+	* file, or 0 for a chunked history, which output (an OutputBackend) says
+	* how to write. Returns false if the output cannot be set up.
+	*
+	***/
+	bool open(FILE *out, const HistoryInfo &history, size_t slot_count, size_t codec_threads, uint column_ticks, int output){
+		setup(out, history, slot_count, codec_threads, column_ticks > 0);
+		if(by_column){
+			columns.open(bout, info, column_ticks);
+		} else {
+			write_history_header(info, bout);
+			if(!chunks.open(bout, info, output))
+				return false;
+		}
+		start(0);
+		return true;
+	}
+	
+	/***
+	*
+	* Append to the chunked history in out, opened for update, after its first
+	* frames, which end at offset (as returned by drain()). history is replaced
+	* by the header of the file. Returns false if out is not such a history.
+	*
+	***/
+	bool resume(FILE *out, HistoryInfo &history, size_t slot_count, size_t codec_threads, uint frames, uint offset, int output){
+		HistoryReader reader;
+		if(reader.open(out, 0))
+			return false;
+		uint64_t tick_count = history.tick_count;
+		history = reader.info;
+		history.tick_count = tick_count;
+		bool ok = history.version == HISTORY_VERSION && reader.chunk_frames == chunk_frames_for(history)
+			&& chunks.resume(out, history, reader.frame_offset, reader.chunk_offset, frames, offset, output);
+		reader.close();
+		if(!ok)
+			return false;
+		setup(out, history, slot_count, codec_threads, false);
+		start(frames);
+		return true;
+	}
+	
+	//Wait for everything committed to be written and handed to the kernel. Returns the offset a chunked history reached
+	uint drain(){
+		std::unique_lock<std::mutex> lock(mutex);
+		space_condition.wait(lock, [this]{ return stored == committed; });
+		if(by_column){
+			fflush(bout);
+		} else {
+			chunks.flush();
+		}
+		return chunks.offset;
+	}
+	
+	//Get the next frame to fill
+	HistoryFrame &acquire(){
+		std::unique_lock<std::mutex> lock(mutex);
+		if(committed - released == count){
+			auto start = std::chrono::steady_clock::now();
+			space_condition.wait(lock, [this]{ return committed - released < count; });
+			stall += std::chrono::steady_clock::now() - start;
+		}
+		return slots[committed % count].frame;
+	}
+	
+	//Queue the frame returned by the last acquire() for encoding and writing
+	void commit(){
+		uint index = committed; //Only ever changed by this thread
+		Slot &slot = slots[index % count];
+		slot.frame.index_rows();
+		slot.index = index;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			slot.encoded = false;
+			committed++;
+		}
+		if(by_column || !codec.pool){
+			ready(slot);
+			return;
+		}
+		
+		const HistoryFrame *previous = index ? &slots[(index - 1) % count].frame : nullptr;
+		const bool key = codec.keyframe(index);
+		if(info.encoding != ENCODING_DELTA){
+			codec.pool->enqueue([this, &slot]{
+				auto start = std::chrono::steady_clock::now();
+				slot.length = encode_frame(info, slot.frame, slot.record);
+				codec.account(slot.frame.count, slot.length, std::chrono::steady_clock::now() - start);
+				ready(slot);
+			});
+			return;
+		}
+		slot.pending = codec.blocks(slot.frame.count);
+		slot.busy    = 0;
+		for(uint b = 0; b < codec.blocks(slot.frame.count); ++b){
+			codec.pool->enqueue([this, &slot, previous, key, b]{
+				auto start = std::chrono::steady_clock::now();
+				slot.sizes[b] = codec.encode_block(slot.frame, previous, b, key, &slot.blocks[b*codec.block_capacity()]);
+				slot.busy += (std::chrono::steady_clock::now() - start).count();
+				if(--slot.pending)
+					return; //The last block to finish assembles the record
+				start = std::chrono::steady_clock::now();
+				slot.length = codec.assemble(slot.frame, key, slot.sizes, slot.blocks, codec.block_capacity(), slot.record);
+				codec.account(slot.frame.count, slot.length, std::chrono::nanoseconds(slot.busy + (std::chrono::steady_clock::now() - start).count()));
+				ready(slot);
+			});
+		}
+	}
+	//Write out everything committed, stop the I/O thread and get the file to disk
+	void close(){
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stop = true;
+			data_condition.notify_one();
+		}
+		io_thread.join();
+		auto start = std::chrono::steady_clock::now();
+		if(by_column){
+			columns.close();
+		} else {
+			chunks.close();
+		}
+		fdatasync(fileno(bout));
+		io_time += std::chrono::steady_clock::now() - start;
+		codec.release();
+		for(size_t i = 0; i < count; ++i){
+			slots[i].frame.release();
+			free(slots[i].record);
+			free(slots[i].blocks);
+			free(slots[i].sizes);
+		}
+		delete[] slots;
+	}
+	
+	double stall_seconds(){
+		return std::chrono::duration<double>(stall).count();
+	}
+	uint bytes_written(){
+		std::unique_lock<std::mutex> lock(mutex); //Also read by the progress reports while the I/O thread runs
+		return written;
+	}
+	//Write throughput, over the time spent writing and syncing rather than encoding
+	double mb_per_second(){
+		return written / 1e6 / (std::max)(std::chrono::duration<double>(io_time).count(), 1e-9);
+	}
+	HistoryCodec &stats(){
+		return codec;
+	}
+
+ private:
+	struct Slot {
+		HistoryFrame frame;
+		uint      index;  //Frame number
+		char     *record; //Encoded record
+		size_t    length;
+		char     *blocks; //Encoded delta blocks, block_capacity() apart
+		uint64_t *sizes;
+		std::atomic<uint64_t> pending; //Delta blocks still encoding
+		std::atomic<uint64_t> busy;    //Nanoseconds spent encoding them
+		bool      encoded; //Ready for the I/O thread
+	};
+	
+	void setup(FILE *out, const HistoryInfo &history, size_t slot_count, size_t codec_threads, bool column_file){
+		bout      = out;
+		info      = history;
+		by_column = column_file;
+		count     = (std::max)(slot_count, (size_t)2);
+		codec.init(info, codec_threads);
+		slots     = new Slot[count];
+		for(size_t i = 0; i < count; ++i){
+			slots[i].frame.allocate(info);
+			slots[i].record = (char*)     alloc_aligned(frame_record_size(info, info.body_count));
+			slots[i].blocks = (char*)     malloc(codec.blocks(info.body_count) * codec.block_capacity());
+			slots[i].sizes  = (uint64_t*) calloc(codec.blocks(info.body_count), sizeof(uint64_t));
+		}
+	}
+	
+	//Start the I/O thread, with frames already in the file
+	void start(uint frames){
+		committed = frames;
+		released  = frames;
+		stored    = frames;
+		stop      = false;
+		stall     = std::chrono::nanoseconds(0);
+		io_time   = std::chrono::nanoseconds(0);
+		written   = 0;
+		io_thread = std::thread([this]{ run(); });
+	}
+	
+	void ready(Slot &slot){
+		std::unique_lock<std::mutex> lock(mutex);
+		slot.encoded = true;
+		data_condition.notify_one();
+	}
+	
+	void run(){
+		std::unique_lock<std::mutex> lock(mutex);
+		for(;;){
+			data_condition.wait(lock, [this]{
+				return (stored < committed && slots[stored % count].encoded) || (stop && stored == committed);
+			});
+			if(stored == committed)
+				return; //Stopped and drained
+			Slot &slot = slots[stored % count];
+			lock.unlock();
+			size_t length;
+			if(by_column){
+				auto start = std::chrono::steady_clock::now();
+				columns.append(slot.frame);
+				io_time += std::chrono::steady_clock::now() - start;
+				length = (info.body_count+1)*info.body_doubles()*sizeof(double);
+			} else {
+				if(!codec.pool)
+					slot.length = codec.encode(slot.frame, slot.index ? &slots[(slot.index - 1) % count].frame : nullptr, slot.index, slot.record);
+				auto start = std::chrono::steady_clock::now();
+				chunks.append(slot.record, slot.length);
+				io_time += std::chrono::steady_clock::now() - start;
+				length = slot.length;
+			}
+			lock.lock();
+			written += length;
+			stored++;
+			//Keep the last frame written as the prediction for the next delta encoded frame
+			released = (info.encoding == ENCODING_DELTA && !by_column) ? stored - 1 : stored;
+			space_condition.notify_one();
+		}
+	}
+	
+	FILE         *bout;
+	HistoryInfo   info;
+	HistoryCodec  codec;
+	ChunkWriter   chunks;
+	ColumnWriter  columns;
+	bool          by_column;
+	Slot         *slots;
+	size_t        count;
+	uint          committed; //Frames committed
+	uint          stored;    //Frames written out
+	uint          released;  //Frames whose slot can be reused
+	bool          stop;
+	uint          written;
+	std::chrono::nanoseconds stall;
+	std::chrono::nanoseconds io_time; //Only touched by the I/O thread, then close()
+	std::mutex mutex;
+	std::condition_variable data_condition;
+	std::condition_variable space_condition;
+	std::thread io_thread;
+};
+
+/***
+*
+* Snapshot the live bodies, their IDs and the barycenter into a frame. Dead
+* bodies are not written, so frames shrink as bodies merge.
+*
+***/
+template<class E>
+void fill_frame(Body<E> &barycenter, Universe<E> &universe, HistoryFrame &frame){
+	const uint body_size = SERIAL_BODY_SIZE(E::dims);
+	char *bodies = (char*) frame.body;
+	frame.count = universe.len;
+	std::memcpy(frame.id, universe.id, universe.len*sizeof(uint32_t));
+	for(uint i = 0; i < universe.len; ++i){
+		universe.body[i].serialize(&bodies[i*body_size]);
 	}
-	std::cout << barycenter.pos.to_string() << ',' << barycenter.vel.to_string() << ',' << barycenter.acc.to_string() << std::endl;
+	barycenter.serialize(&bodies[universe.len*body_size]);
 }
 
-void write_bin_header(uint tick_limit, FILE *bout){
-	unsigned short s = sizeof(uint);
-	uint count = BODY_COUNT;
-	uint ticks = tick_limit;
-	char blurb1[]="NBODY SIMULATION";
-	char blurb2[]="UNIVERSE HISTORY";
-	char dest_buf[32+sizeof(uint)*2];
-	
-	std::memcpy(&dest_buf[00+s*0], &blurb1,16);
-	std::memcpy(&dest_buf[16+s*0], &count, s);
-	std::memcpy(&dest_buf[16+s*1], &ticks, s);
-	std::memcpy(&dest_buf[16+s*2], &blurb2,16);
-	fwrite(dest_buf, sizeof(char), 32 + sizeof(uint)*2, bout);
-	fflush(bout);
+//Hand a frame to the writer, which encodes it as a frame record (see History.h)
+template<class E>
+void write_bin_frame(Body<E> &barycenter, Universe<E> &universe, HistoryWriter &writer){
+	fill_frame(barycenter, universe, writer.acquire());
+	writer.commit();
 }
 
-void write_bin_frame(Body &barycenter, Body (&universe)[BODY_COUNT], FILE *bout){
-	char buf[SERIAL_BODY_SIZE];
-	for(uint i = 0; i < BODY_COUNT; ++i){
-		universe[i].serialize(buf);
-		fwrite(buf, sizeof(char), SERIAL_BODY_SIZE, bout);
-	}
-	barycenter.serialize(buf);
-	fwrite(buf, sizeof(char), SERIAL_BODY_SIZE, bout);
-	fflush(bout);
+//Publish a frame to the live stream, unless it is full and dropping frames
+template<class E>
+void stream_frame(Body<E> &barycenter, Universe<E> &universe, FrameStream &stream, uint tick){
+	HistoryFrame *frame = stream.acquire(tick);
+	if(!frame)
+		return;
+	fill_frame(barycenter, universe, *frame);
+	stream.publish();
 }
 
-void create_universe(Body (&universe)[BODY_COUNT], Body &barycenter, int argc, char *argv[]){
+template<class E>
+void create_universe(Universe<E> &universe, std::default_random_engine &rand_engn, int argc, char *argv[]){
 	double DISK_RADIUS = 10.0;
 	double INIT_MASS   = 0.001;
 	double VEL_MEAN     = std::stod(argv[2]);
 	double VEL_STDDEV   = std::stod(argv[3]);
+	double INCLINATION  = get_opt(argc, argv, "inclination") ? std::stod(get_opt(argc, argv, "inclination"))*PI/180.0 : 0; //Tilt of the disk about the X axis (3D only)
 	
 	std::uniform_real_distribution<double> rand_u(0.0,1.0);
 	std::normal_distribution<double> rand_n(VEL_MEAN,VEL_STDDEV);
-	std::default_random_engine rand_engn;
-	rand_engn.seed(std::chrono::system_clock::now().time_since_epoch().count());
 	auto rand_unif = [&rand_u, &rand_engn](){return rand_u(rand_engn);};
 	auto rand_nrml = [&rand_n, &rand_engn](){return rand_n(rand_engn);};
 	
@@ -335,167 +1018,842 @@ void create_universe(Body (&universe)[BODY_COUNT], Body &barycenter, int argc, c
 	universe[2].vel = {0,std::stod(argv[2])}; //.45 for stable orbit
 	*/
 	
-	universe[0].mass.set(4);
-	universe[0].alive = true;
-	for(uint i = 1; i < BODY_COUNT; i++){
-		Body &b = universe[i];
+	universe.body[0].mass.set(4);
+	universe.body[0].alive = true;
+	for(uint i = 1; i < universe.body_count; i++){
+		Body<E> &b = universe.body[i];
 		b.alive = true;
 		b.mass.set(INIT_MASS);
-		double radial_dist = pow(rand_unif(), 0.75) * DISK_RADIUS; 
+		double radial_dist = pow(rand_unif(), 0.75) * DISK_RADIUS;
 		double theta = rand_unif()*PI*2.0;
-		b.pos = { cos(theta), sin(theta) };
-		b.pos*= radial_dist;
+		b.pos = { };
+		b.pos[0] = cos(theta) * radial_dist;
+		b.pos[1] = sin(theta) * radial_dist;
 		
 		//theta = rand_unif()*PI*2.0;
-		theta = atan2(b.pos.y,b.pos.x) + 0.5*PI;
-		b.vel = { cos(theta), sin(theta) };
-		b.vel*= rand_nrml() * tanh(radial_dist*PI/DISK_RADIUS); //Slow in middle, faster near edge
-	}
-}
-
-void rebuild_idx(Body (&universe)[BODY_COUNT], UnivIdx &univ_idx){
-	univ_idx.len = 0;
-	for(size_t i = univ_idx.arr[0]; i < BODY_COUNT; ++i){
-		if(universe[i].alive){
-			univ_idx.arr[univ_idx.len++]=i;
+		theta = atan2(b.pos[1],b.pos[0]) + 0.5*PI;
+		double speed = rand_nrml() * tanh(radial_dist*PI/DISK_RADIUS); //Slow in middle, faster near edge
+		b.vel = { };
+		b.vel[0] = cos(theta) * speed;
+		b.vel[1] = sin(theta) * speed;
+		
+		if(E::dims == 3){
+			b.pos[2] = b.pos[1] * sin(INCLINATION);
+			b.pos[1] = b.pos[1] * cos(INCLINATION);
+			b.vel[2] = b.vel[1] * sin(INCLINATION);
+			b.vel[1] = b.vel[1] * cos(INCLINATION);
 		}
 	}
+	
+	for(uint i = 0; i < universe.body_count; i++){
+		universe.id[i] = i;
+	}
+	universe.len = universe.body_count;
 }
 
-void collide_universe(Body (&universe)[BODY_COUNT], UnivIdx &univ_idx){
+template<class E>
+void collide_universe(Universe<E> &universe){
+	using real   = typename E::real;
+	using Vector = typename Universe<E>::Vector;
 	
 	//Get indicies of live bodies with collision flag set
-	size_t idx_arr[BODY_COUNT];
+	size_t *idx_arr = universe.scratch;
 	size_t idx_len = 0;
-	for(uint i = 0; i < BODY_COUNT; ++i){
-		if(universe[i].alive && universe[i].collide){
+	for(uint i = 0; i < universe.len; ++i){
+		if(universe.body[i].collide){
 			idx_arr[idx_len]=i;
 			idx_len++;
 		}
 	}
 	
-	bool idx_dirty = false;
-		
 	for(uint i = 0; i < idx_len; ++i){
-		Body &a = universe[idx_arr[i]];
+		Body<E> &a = universe.body[idx_arr[i]];
 		if(!(a.alive && a.collide))
 			continue; //Skip dead and non-colliding particles
 		for(uint j = i+1; j < idx_len; ++j){
-			Body &b = universe[idx_arr[j]];
+			Body<E> &b = universe.body[idx_arr[j]];
 			if(!(b.alive && b.collide))
 				continue; //Skip dead and non-colliding particles
 			
 			Vector disp = a.pos - b.pos;
-			double dist_sq = disp.x * disp.x + disp.y * disp.y;
-			double m_ab	   = a.mass.get()+b.mass.get();
-			double r_ab	   = a.mass.rad()+b.mass.rad();
+			real dist_sq = disp.norm_sq();
+			real m_ab	 = a.mass.get()+b.mass.get();
+			real r_ab	 = a.mass.rad()+b.mass.rad();
 			if(r_ab*r_ab > dist_sq){
 				//a and b are colliding!
-				double a_m = a.mass.get();
-				double b_m = b.mass.get();
+				real a_m = a.mass.get();
+				real b_m = b.mass.get();
 				
 				a.mass.set(m_ab);
 				a.pos = ((a.pos*a_m)+(b.pos*b_m))/(m_ab);
 				a.vel = ((a.vel*a_m)+(b.vel*b_m))/(m_ab);
 				a.acc = ((a.acc*a_m)+(b.acc*b_m))/(m_ab); //AFAIK, averaging the accelerations between two colliding bodies makes little sense, but ¯\_(ツ)_/¯
 				
-				b = { 0 };
 				b.alive=false;
 				b.collide = false;
-				idx_dirty = true;
 			}
 		}
 		a.collide = false;
 	}
-	if(idx_dirty)
-		rebuild_idx(universe, univ_idx);
+	
+	//Swap-remove the merged bodies. idx_arr is ascending, so walking it backwards
+	//guarantees the body swapped into each hole is live.
+	for(size_t i = idx_len; i-- > 0;){
+		if(!universe.body[idx_arr[i]].alive)
+			universe.remove(idx_arr[i]);
+	}
 }
 
-int main(int argc, char *argv[]) {
-	FILE *bout = fopen(argv[1], "wb"); //Binary output file
-	char *bbuf = (char*) malloc((BODY_COUNT+1)*SERIAL_BODY_SIZE);
-	setbuf(bout, bbuf);
+/***
+*
+* A checkpoint holds everything the main loop needs to carry on from the start
+* of a tick: the live bodies exactly as they are in memory (collide flags and
+* new_* state included), their IDs, the barycenter and its cached mass, the
+* random engine, and how far the history had been written. Resuming from it
+* under the same engine, parameters and band count gives bit-identical ticks.
+*
+* The header records the engine and parameters so a checkpoint is refused by
+* any other build of the simulation; bodies are raw Body<E> structs. The body
+* of the file is checksummed, written to <FILE>.tmp and renamed over <FILE>
+* once it is on disk, so a crash while checkpointing leaves the last one.
+*
+***/
+#pragma pack(push, 1)
+struct CheckpointHeader {
+	char     blurb[16];
+	uint64_t dims;
+	uint64_t real_size;
+	uint64_t body_size;  //sizeof(Body<E>)
+	uint64_t symmetric;
+	char     softening[8];
+	double   dt;
+	double   grav;
+	double   epsilon;
+	uint64_t tick;       //Next tick to simulate
+	uint64_t body_count;
+	uint64_t len;
+	uint64_t bands;
+	uint64_t history_offset; //End of the history's first tick frames
+	uint64_t rng_size;   //Bytes of random engine state
+	uint64_t sum;        //Checksum of the rest of the file
+};
+#pragma pack(pop)
+
+static const char CHECKPOINT_BLURB[16] = {'U','N','I','V','E','R','S','E',' ','C','H','E','C','K','P','T'};
+
+template<class E>
+void checkpoint_header(CheckpointHeader &head, const Params &p){
+	head = { };
+	memcpy(head.blurb, CHECKPOINT_BLURB, sizeof(CHECKPOINT_BLURB));
+	head.dims      = E::dims;
+	head.real_size = sizeof(typename E::real);
+	head.body_size = sizeof(Body<E>);
+	head.symmetric = E::symmetric;
+	strncpy(head.softening, E::softening::name, sizeof(head.softening));
+	head.dt      = p.dt;
+	head.grav    = p.grav;
+	head.epsilon = p.epsilon;
+}
+
+//Sections of a checkpoint after the header, each padded to whole words
+inline size_t checkpoint_size(const CheckpointHeader &head){
+	return pad8(head.len*sizeof(uint32_t)) + (head.len + 1)*head.body_size + pad8(head.rng_size);
+}
+
+template<class E>
+bool write_checkpoint(const char *path, uint tick, const Params &p, Universe<E> &universe, Body<E> &barycenter, std::default_random_engine &rng, uint history_offset){
+	std::ostringstream rng_state;
+	rng_state << rng;
+	CheckpointHeader head;
+	checkpoint_header<E>(head, p);
+	head.tick           = tick;
+	head.body_count     = universe.body_count;
+	head.len            = universe.len;
+	head.bands          = universe.bands;
+	head.history_offset = history_offset;
+	head.rng_size       = rng_state.str().size();
+	
+	size_t size = checkpoint_size(head);
+	char *data = (char*) calloc(size, 1);
+	char *p_data = data;
+	memcpy(p_data, universe.id, head.len*sizeof(uint32_t));
+	p_data += pad8(head.len*sizeof(uint32_t));
+	memcpy(p_data, universe.body, head.len*sizeof(Body<E>));
+	p_data += head.len*sizeof(Body<E>);
+	memcpy(p_data, &barycenter, sizeof(Body<E>));
+	p_data += sizeof(Body<E>);
+	memcpy(p_data, rng_state.str().data(), head.rng_size);
+	head.sum = checksum(CHECKSUM_SEED, data, size);
 	
-	bool PRINT_CSV = argc > 5;
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *out = fopen(tmp.c_str(), "wb");
+	bool ok = out
+		&& 1 == fwrite(&head, sizeof(head), 1, out)
+		&& 1 == fwrite(data, size, 1, out)
+		&& !fflush(out)
+		&& !fsync(fileno(out));
+	ok = out && !fclose(out) && ok && !rename(tmp.c_str(), path);
+	free(data);
+	return ok;
+}
+
+/***
+*
+* Allocate the universe and restore it, the barycenter and the random engine
+* from a checkpoint taken by the same engine with the same parameters.
+*
+* Returns false, having said why on stderr, if that is not possible.
+*
+***/
+template<class E>
+bool read_checkpoint(const char *path, const Params &p, Universe<E> &universe, Body<E> &barycenter, std::default_random_engine &rng, CheckpointHeader &head){
+	FILE *in = fopen(path, "rb");
+	if(!in){
+		fprintf(stderr, "Could not open %s!\n", path);
+		return false;
+	}
+	if(1 != fread(&head, sizeof(head), 1, in) || memcmp(head.blurb, CHECKPOINT_BLURB, sizeof(CHECKPOINT_BLURB))){
+		fclose(in);
+		fprintf(stderr, "%s is not a checkpoint!\n", path);
+		return false;
+	}
+	CheckpointHeader expect;
+	checkpoint_header<E>(expect, p);
+	if(head.dims != expect.dims || head.real_size != expect.real_size || head.body_size != expect.body_size
+		|| head.symmetric != expect.symmetric || memcmp(head.softening, expect.softening, sizeof(head.softening))
+		|| head.dt != expect.dt || head.grav != expect.grav || head.epsilon != expect.epsilon){
+		fclose(in);
+		fprintf(stderr, "Checkpoint was taken with a different engine or parameters!\n");
+		return false;
+	}
+	if(head.len > head.body_count || head.body_count > UINT32_MAX){
+		fclose(in);
+		fprintf(stderr, "Checkpoint is corrupt!\n");
+		return false;
+	}
+	size_t size = checkpoint_size(head);
+	char *data = (char*) malloc(size);
+	bool ok = 1 == fread(data, size, 1, in) && checksum(CHECKSUM_SEED, data, size) == head.sum;
+	fclose(in);
+	if(!ok){
+		fprintf(stderr, "Checkpoint is corrupt!\n");
+		free(data);
+		return false;
+	}
 	
-	progschj::ThreadPool pool;
+	universe.allocate(head.body_count, head.bands);
+	universe.len = head.len;
+	const char *p_data = data;
+	memcpy(universe.id, p_data, head.len*sizeof(uint32_t));
+	p_data += pad8(head.len*sizeof(uint32_t));
+	memcpy(universe.body, p_data, head.len*sizeof(Body<E>));
+	p_data += head.len*sizeof(Body<E>);
+	memcpy(&barycenter, p_data, sizeof(Body<E>));
+	p_data += sizeof(Body<E>);
+	std::istringstream rng_state(std::string(p_data, head.rng_size));
+	rng_state >> rng;
+	free(data);
+	return true;
+}
+
+/***
+*
+* Takes the checkpoints of a run. In place, the simulation stalls for the
+* whole write. Forked, it only stalls while the history is drained and the
+* process forks; the child writes the copy-on-write image of the universe,
+* frozen at the tick boundary, while the parent carries on integrating. Only
+* one child runs at once, so a checkpoint due while the last is still being
+* written waits for it, and that wait is counted as stall too.
+*
+***/
+struct Checkpointer {
+	const char *path;
+	int    history; //History file descriptor, synced before each checkpoint
+	bool   forked;
+	pid_t  child;
+	uint   taken;
+	uint   failed;
+	std::chrono::nanoseconds stall;
+	std::chrono::nanoseconds max_stall;
 	
-	uint tick_limit = (unsigned)std::stoull(argv[4]);
+	void open(const char *checkpoint, FILE *bout, bool fork_mode){
+		path      = checkpoint;
+		history   = fileno(bout);
+		forked    = fork_mode;
+		child     = 0;
+		taken     = 0;
+		failed    = 0;
+		stall     = std::chrono::nanoseconds(0);
+		max_stall = std::chrono::nanoseconds(0);
+	}
 	
-	if(PRINT_CSV)
-		write_csv_header();
+	template<class E>
+	void take(uint tick, const Params &p, Universe<E> &universe, Body<E> &barycenter, std::default_random_engine &rng, HistoryWriter &writer){
+		auto start = std::chrono::steady_clock::now();
+		wait();
+		uint offset = writer.drain();
+		pid_t pid = forked ? fork() : -1;
+		if(pid == 0){
+			//Child: only this thread exists here, so leave without running destructors or flushing stdio
+			bool ok = !fsync(history) && write_checkpoint(path, tick, p, universe, barycenter, rng, offset);
+			_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+		if(pid > 0){
+			child = pid;
+		} else if(fsync(history) || !write_checkpoint(path, tick, p, universe, barycenter, rng, offset)){
+			failed++;
+			fprintf(stderr, "\nCould not write checkpoint %s!\n", path);
+		}
+		taken++;
+		auto time = std::chrono::steady_clock::now() - start;
+		stall += time;
+		max_stall = (std::max)(max_stall, std::chrono::duration_cast<std::chrono::nanoseconds>(time));
+	}
+	
+	//Wait for the checkpoint being written by a child, if any
+	void wait(){
+		if(!child)
+			return;
+		int status;
+		if(waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS){
+			failed++;
+			fprintf(stderr, "\nCould not write checkpoint %s!\n", path);
+		}
+		child = 0;
+	}
+};
+
+/***
+*
+* Reports how a run is going every so often of wall-clock time, rather than
+* every tick. Between reports tick() only counts and reads the clock.
+*
+* Each report gives ticks and pair interactions per second since the last one,
+* the live body count, merges since the universe was created, history written
+* per second and the time left at the average rate so far. Pair interactions
+* are pair_force() evaluations: len*(len-1) a tick for the full kernel and
+* half that for the symmetric one.
+*
+* Reports rewrite a status line on stdout, unless stdout carries CSV, and can
+* also be appended to a file as one JSON object per line. A last report with
+* "done" set is made by close().
+*
+***/
+struct Telemetry {
+	FILE *json;      //JSON lines, or nullptr
+	bool  line;      //Status line on stdout
+	int   pad_len;
+	uint  tick_limit;
+	uint  first_tick;
+	uint  last_tick; //Tick of the last report
+	uint  last_bytes;
+	uint  pairs;     //Pair interactions since the last report
+	std::chrono::steady_clock::duration   every;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::time_point last;
+	
+	//json_path may be nullptr for no JSON lines, or "-" for stderr. Returns false if it cannot be opened
+	bool open(uint first, uint limit, double seconds, bool status_line, const char *json_path){
+		json = nullptr;
+		if(json_path)
+			json = strcmp(json_path, "-") ? fopen(json_path, "w") : stderr;
+		line       = status_line;
+		pad_len    = (int)(0.5+log10(limit))+1;
+		tick_limit = limit;
+		first_tick = first;
+		last_tick  = first;
+		last_bytes = 0;
+		pairs      = 0;
+		every      = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+		start      = std::chrono::steady_clock::now();
+		last       = start;
+		return !json_path || json;
+	}
+	
+	//Count a tick just finished, so tick+1 are done. writer is nullptr if no history is kept
+	template<class E>
+	void tick(uint tick, const Universe<E> &universe, HistoryWriter *writer){
+		uint len = universe.len;
+		pairs += E::symmetric ? len*(len-1)/2 : len*(len-1);
+		auto now = std::chrono::steady_clock::now();
+		if(now - last >= every)
+			report(now, tick+1, universe, writer, false);
+	}
+	
+	template<class E>
+	void close(const Universe<E> &universe, HistoryWriter *writer){
+		report(std::chrono::steady_clock::now(), tick_limit, universe, writer, true);
+		if(json && json != stderr)
+			fclose(json);
+	}
+	
+ private:
+	template<class E>
+	void report(std::chrono::steady_clock::time_point now, uint tick, const Universe<E> &universe, HistoryWriter *writer, bool done){
+		double interval = (std::max)(std::chrono::duration<double>(now - last).count(), 1e-9);
+		double elapsed  = (std::max)(std::chrono::duration<double>(now - start).count(), 1e-9);
+		uint   bytes    = writer ? writer->bytes_written() : 0;
+		double ticks_per_second = (tick - last_tick) / interval;
+		double pairs_per_second = pairs / interval;
+		double mb_per_second    = (bytes - last_bytes) / 1e6 / interval;
+		double eta = tick > first_tick ? (tick_limit - tick) * elapsed / (tick - first_tick) : 0;
+		uint   merges = universe.body_count - universe.len;
+		
+		if(line){
+			uint s = (uint) eta;
+			printf("%0*lu/%lu  %.1f ticks/s  %.3g pairs/s  %lu bodies  %lu merges  %.1f MB/s  ETA %lu:%02lu:%02lu   \r",
+				pad_len, tick, tick_limit, ticks_per_second, pairs_per_second, universe.len, merges, mb_per_second, s/3600, s/60%60, s%60);
+			fflush(stdout);
+		}
+		if(json){
+			fprintf(json, "{\"tick\":%lu,\"tick_limit\":%lu,\"elapsed\":%.3f,\"ticks_per_s\":%.6g,\"pairs_per_s\":%.6g,"
+				"\"bodies\":%lu,\"merges\":%lu,\"bytes\":%lu,\"mb_per_s\":%.6g,\"eta\":%.3f,\"done\":%s}\n",
+				tick, tick_limit, elapsed, ticks_per_second, pairs_per_second, universe.len, merges, bytes, mb_per_second, eta, done ? "true" : "false");
+			fflush(json);
+		}
+		last       = now;
+		last_tick  = tick;
+		last_bytes = bytes;
+		pairs      = 0;
+	}
+};
+
+//Phases of the tick timed with -DPHASE_TIMING. The barriers are the main thread waiting on the pool's tasks
+enum Phase {PHASE_CHECKPOINT, PHASE_COLLIDE, PHASE_BARYCENTER, PHASE_WRITE, PHASE_STREAM, PHASE_CSV_FORMAT,
+	PHASE_POS_TASKS, PHASE_POS_BARRIER, PHASE_CSV_GATHER, PHASE_FORCE_TASKS, PHASE_FORCE_BARRIER,
+	PHASE_UPDATE_TASKS, PHASE_UPDATE_BARRIER, PHASE_PROGRESS, PHASE_COUNT};
+static const char *PHASE_NAMES[PHASE_COUNT] = {"checkpoint", "collide", "barycenter", "write_frame", "stream", "csv_format",
+	"pos_tasks", "pos_barrier", "csv_gather", "force_tasks", "force_barrier",
+	"update_tasks", "update_barrier", "progress"};
+
+//Phases counted with --counters, and the unit of work each is reported per
+enum CountedPhase {COUNTED_FORCE, COUNTED_COLLIDE, COUNTED_OUTPUT, COUNTED_COUNT};
+static const char *COUNTED_NAMES[COUNTED_COUNT] = {"force", "collide", "output"};
+static const char *COUNTED_UNITS[COUNTED_COUNT] = {"pair interaction", "body", "frame"};
+
+/***
+*
+* Thread IDs of the main thread followed by each of the pool's threads. Every
+* task waits until all of them have started, so each runs on its own thread.
+*
+***/
+pid_t *pool_thread_ids(progschj::ThreadPool &pool, size_t thread_count){
+	pid_t *tids = (pid_t*) malloc((thread_count + 1)*sizeof(pid_t));
+	tids[0] = syscall(SYS_gettid);
+	std::atomic<size_t> arrived(0);
+	for(size_t k = 0; k < thread_count; ++k){
+		pool.enqueue([k, tids, thread_count, &arrived]{
+			tids[k + 1] = syscall(SYS_gettid);
+			arrived++;
+			while(arrived < thread_count){
+				std::this_thread::yield();
+			}
+		});
+	}
+	pool.wait_until_empty();
+	pool.wait_until_nothing_in_flight();
+	return tids;
+}
+
+template<class E>
+int simulate(int argc, char *argv[], const Params &p){
+	const char *resume = get_opt(argc, argv, "resume");
+	const bool keep_history = strcmp(argv[1], "-"); //"-" only streams, writing no history
+	FILE *bout = keep_history ? fopen(argv[1], resume ? "r+b" : "w+b") : nullptr; //Binary output file, appended to when resuming; readable so it can be mapped
+	if(keep_history && !bout){
+		fprintf(stderr, "Could not open %s!\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	
+	uint body_count = BODY_COUNT;
+	if(get_opt(argc, argv, "bodies"))
+		body_count = std::stoull(get_opt(argc, argv, "bodies"));
+	if(body_count < 1){
+		fprintf(stderr, "Body count must be at least 1!\n");
+		return EXIT_FAILURE;
+	}
+	
+	size_t write_buffers = WRITE_BUFFERS;
+	if(get_opt(argc, argv, "write-buffers"))
+		write_buffers = (std::max)(1ull, std::stoull(get_opt(argc, argv, "write-buffers")));
+	
+	HistoryInfo info = { };
+	info.dims     = E::dims;
+	info.encoding = ENCODING_FULL;
+	info.fields   = FIELD_POS | FIELD_MASS;
+	info.bits     = QUANT_BITS;
+	info.dt       = p.dt;
+	info.keyframe = KEYFRAME;
+	const char *encoding = get_opt(argc, argv, "encoding");
+	if(encoding && !strcmp(encoding, "compact")){
+		info.encoding = ENCODING_COMPACT;
+	} else if(encoding && !strcmp(encoding, "delta")){
+		info.encoding = ENCODING_DELTA;
+	} else if(encoding && strcmp(encoding, "full")){
+		fprintf(stderr, "Unknown encoding \"%s\", expected full, compact or delta\n", encoding);
+		return EXIT_FAILURE;
+	}
+	if(get_opt(argc, argv, "fields"))
+		info.fields = parse_fields(get_opt(argc, argv, "fields"));
+	if(get_opt(argc, argv, "bits"))
+		info.bits = std::stoull(get_opt(argc, argv, "bits"));
+	uint column_ticks = 0;
+	const char *layout = get_opt(argc, argv, "layout");
+	if(layout && !strcmp(layout, "columns")){
+		column_ticks = COLUMN_TICKS;
+	} else if(layout && strcmp(layout, "chunks")){
+		fprintf(stderr, "Unknown layout \"%s\", expected chunks or columns\n", layout);
+		return EXIT_FAILURE;
+	}
+	const char *checkpoint = get_opt(argc, argv, "checkpoint");
+	if(!checkpoint)
+		checkpoint = resume;
+	uint checkpoint_every = get_opt(argc, argv, "checkpoint-every") ? std::stoull(get_opt(argc, argv, "checkpoint-every")) : CHECKPOINT_EVERY;
+	if(checkpoint && (column_ticks || !keep_history)){
+		fprintf(stderr, "Checkpoints need a chunked history!\n");
+		return EXIT_FAILURE;
+	}
+	const char *checkpoint_mode = get_opt(argc, argv, "checkpoint-mode");
+	if(checkpoint_mode && strcmp(checkpoint_mode, "fork") && strcmp(checkpoint_mode, "sync")){
+		fprintf(stderr, "Unknown checkpoint mode \"%s\", expected fork or sync\n", checkpoint_mode);
+		return EXIT_FAILURE;
+	}
+	Checkpointer checkpointer = { };
+	if(checkpoint)
+		checkpointer.open(checkpoint, bout, !checkpoint_mode || !strcmp(checkpoint_mode, "fork"));
+	
+	const char *stream_name = get_opt(argc, argv, "stream");
+	uint stream_slots = get_opt(argc, argv, "stream-slots") ? (std::max)(1ull, std::stoull(get_opt(argc, argv, "stream-slots"))) : STREAM_SLOTS;
+	const char *stream_policy = get_opt(argc, argv, "stream-policy");
+	if(stream_policy && strcmp(stream_policy, "drop") && strcmp(stream_policy, "block")){
+		fprintf(stderr, "Unknown stream policy \"%s\", expected drop or block\n", stream_policy);
+		return EXIT_FAILURE;
+	}
+	if(!keep_history && (!stream_name || resume)){
+		fprintf(stderr, "Need a history file unless streaming a new run!\n");
+		return EXIT_FAILURE;
+	}
+	int output = OUTPUT_STDIO;
+	const char *output_name = get_opt(argc, argv, "output");
+	if(output_name && !strcmp(output_name, "mmap")){
+		output = OUTPUT_MMAP;
+	} else if(output_name && !strcmp(output_name, "uring")){
+		output = OUTPUT_URING;
+	} else if(output_name && strcmp(output_name, "stdio")){
+		fprintf(stderr, "Unknown output \"%s\", expected stdio, mmap or uring\n", output_name);
+		return EXIT_FAILURE;
+	}
+	if(get_opt(argc, argv, "keyframe"))
+		info.keyframe = std::stoull(get_opt(argc, argv, "keyframe"));
+	size_t codec_threads = CODEC_THREADS;
+	if(get_opt(argc, argv, "codec-threads"))
+		codec_threads = std::stoull(get_opt(argc, argv, "codec-threads"));
+	if(!info.fields || (info.bits != 16 && info.bits != 32)){
+		fprintf(stderr, "Fields must be a list of pos, vel, acc and mass, and bits 16 or 32!\n");
+		return EXIT_FAILURE;
+	}
+	
+	double progress_every = get_opt(argc, argv, "progress-every") ? std::stod(get_opt(argc, argv, "progress-every")) : PROGRESS_EVERY;
+	const char *progress_json = get_opt(argc, argv, "progress-json");
+	
+	bool PRINT_CSV = get_opt(argc, argv, "csv") || (argc > 5 && strncmp(argv[5], "--", 2)); //Any non-option fifth argument also enables CSV
 	
-	write_bin_header(tick_limit, bout);
+	size_t thread_count = (std::max)(2u, std::thread::hardware_concurrency());
+	progschj::ThreadPool pool(thread_count);
+	const char *trace_path = get_opt(argc, argv, "trace");
+	if(trace_path)
+		pool.start_trace(get_opt(argc, argv, "trace-events") ? std::stoull(get_opt(argc, argv, "trace-events")) : TRACE_EVENTS);
 	
-	Body universe[BODY_COUNT] = { 0 };
-	Body barycenter = { 0 };
+	uint tick_limit = (unsigned)std::stoull(argv[4]);
+	
+	//Seed from the clock unless given one; the seed is printed so the run can be repeated
+	uint seed = get_opt(argc, argv, "seed") ? std::stoull(get_opt(argc, argv, "seed")) : std::chrono::system_clock::now().time_since_epoch().count();
+	std::default_random_engine rng(seed);
 	
-	if(!PRINT_CSV)
-		printf("Creating universe...\r\n");
-	create_universe(universe, barycenter, argc, argv);
-	if(!PRINT_CSV)
-		printf("Universe created!\r\n");
+	Universe<E> universe = { };
+	Body<E> barycenter = { };
+	HistoryWriter writer;
+	uint first_tick = 0;
 	
-	UnivIdx univ_idx = { 0 };
-	rebuild_idx(universe, univ_idx);
+	if(resume){
+		CheckpointHeader head;
+		if(!read_checkpoint(resume, p, universe, barycenter, rng, head))
+			return EXIT_FAILURE;
+		info.body_count = head.body_count;
+		info.tick_count = tick_limit;
+		if(!writer.resume(bout, info, write_buffers, codec_threads, head.tick, head.history_offset, output)){
+			fprintf(stderr, "%s does not hold the %lu ticks checkpointed!\n", argv[1], head.tick);
+			return EXIT_FAILURE;
+		}
+		first_tick = head.tick;
+		if(!PRINT_CSV)
+			printf("Resuming from tick %lu\r\n", first_tick);
+	} else {
+		if(PRINT_CSV)
+			write_csv_header(body_count, E::dims);
+		
+		info.body_count = body_count;
+		info.tick_count = tick_limit;
+		if(keep_history && !writer.open(bout, info, write_buffers, codec_threads, column_ticks, output)){
+			fprintf(stderr, "Could not set up output to %s!\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		
+		universe.allocate(body_count, thread_count);
+		
+		if(!PRINT_CSV)
+			printf("Creating universe with seed %lu...\r\n", seed);
+		create_universe(universe, rng, argc, argv);
+		if(!PRINT_CSV)
+			printf("Universe created!\r\n");
+		
+		update_barycenter(barycenter, universe);
+		//Ensure the universe is using barycentric coordinates and reference frame
+		for(uint i = 0; i < universe.len; i++){
+			universe.body[i].pos-=barycenter.pos;
+			universe.body[i].vel-=barycenter.vel;
+		}
+		update_barycenter(barycenter, universe);
+	}
 	
-	update_barycenter(barycenter, universe, univ_idx);
-	//Ensure the universe is using barycentric coordinates and reference frame
-	for(uint i = 0; i < BODY_COUNT; i++){
-		universe[i].pos-=barycenter.pos;
-		universe[i].vel-=barycenter.vel;
+	FrameStream stream;
+	if(stream_name && !stream.create(stream_name, info, stream_slots, stream_policy && !strcmp(stream_policy, "block"))){
+		fprintf(stderr, "Could not create stream %s!\n", stream_name);
+		return EXIT_FAILURE;
 	}
-	update_barycenter(barycenter, universe, univ_idx);
 	
-	int pad_len = (int)(0.5+log10(tick_limit))+1;
+	//Checkpoints fall on chunk boundaries, so the history can be cut back to one
+	uint chunk_frames = chunk_frames_for(info);
+	checkpoint_every = (std::max)(checkpoint_every, (uint)1);
+	checkpoint_every = (checkpoint_every + chunk_frames - 1) / chunk_frames * chunk_frames;
 	
+	Telemetry telemetry;
+	if(!telemetry.open(first_tick, tick_limit, progress_every, !PRINT_CSV, progress_json)){
+		fprintf(stderr, "Could not open %s!\n", progress_json);
+		return EXIT_FAILURE;
+	}
+	
+	CsvWriter<E> csv;
+	if(PRINT_CSV)
+		csv.open(universe.body_count, thread_count);
 	int csv_skip_factor = 1;
 	if(tick_limit > 25000)
 		csv_skip_factor = (tick_limit/25000)+1;
-
-	for(uint tick = 0; tick < tick_limit; ++tick){
-		collide_universe(universe, univ_idx);
+	
+	PhaseTimer phases;
+	phases.open(PHASE_NAMES, PHASE_COUNT);
+	
+	PerfCounters counters;
+	bool counting = false;
+	if(get_opt(argc, argv, "counters")){
+		pid_t *tids = pool_thread_ids(pool, thread_count);
+		counting = counters.open(tids, thread_count + 1, COUNTED_NAMES, COUNTED_UNITS, COUNTED_COUNT);
+		if(!counting)
+			fprintf(stderr, "Performance counters unavailable (%s), running without them\n", counters.error);
+		free(tids);
+	}
+	
+	for(uint tick = first_tick; tick < tick_limit; ++tick){
+		phases.start();
+		if(checkpoint && tick > first_tick && !(tick%checkpoint_every)){
+			checkpointer.take(tick, p, universe, barycenter, rng, writer);
+			phases.mark(PHASE_CHECKPOINT);
+		}
+		
+		if(counting)
+			counters.begin();
+		uint live = universe.len;
+		collide_universe(universe);
+		if(counting)
+			counters.end(COUNTED_COLLIDE, live);
+		phases.mark(PHASE_COLLIDE);
 		
-		update_barycenter(barycenter, universe, univ_idx);
-		write_bin_frame(barycenter, universe, bout);
+		update_barycenter(barycenter, universe);
+		phases.mark(PHASE_BARYCENTER);
+		if(counting)
+			counters.begin();
+		if(keep_history){
+			write_bin_frame(barycenter, universe, writer);
+			phases.mark(PHASE_WRITE);
+		}
+		if(stream_name){
+			stream_frame(barycenter, universe, stream, tick);
+			phases.mark(PHASE_STREAM);
+		}
 		
-		if(PRINT_CSV && !(tick%csv_skip_factor)){
-			write_csv_frame(barycenter, universe);			
+		const bool csv_row = PRINT_CSV && !(tick%csv_skip_factor);
+		if(csv_row){
+			pool.trace_label("csv");
+			csv.format(barycenter, universe, pool);
+			phases.mark(PHASE_CSV_FORMAT);
 		}
+		if(counting)
+			counters.end(COUNTED_OUTPUT, keep_history || stream_name || csv_row);
 		
-		for(uint i = 0; i < univ_idx.len; ++i){
-			pool.enqueue([i, &universe, &univ_idx]{
-				universe[univ_idx.arr[i]].calc_pos();
+		pool.trace_label("pos");
+		for(uint i = 0; i < universe.len; ++i){
+			pool.enqueue([i, &universe, &p]{
+				universe.body[i].calc_pos(p);
 			});
 		}
+		phases.mark(PHASE_POS_TASKS);
 		pool.wait_until_empty();
 		pool.wait_until_nothing_in_flight();
+		phases.mark(PHASE_POS_BARRIER);
+		if(csv_row){
+			csv.gather();
+			phases.mark(PHASE_CSV_GATHER);
+		}
 		
-		for(uint i = 0; i < univ_idx.len; ++i){
-			pool.enqueue([i, &universe, &univ_idx]{
-				universe[univ_idx.arr[i]].calc_force(universe, i, univ_idx);
-			});
+		if(counting)
+			counters.begin();
+		pool.trace_label("force");
+		if(E::symmetric){
+			split_bands(universe);
+			for(uint band = 0; band < universe.bands; ++band){
+				pool.enqueue([band, &universe, &p]{
+					calc_force_band(universe, band, p);
+				});
+			}
+		} else {
+			for(uint i = 0; i < universe.len; ++i){
+				pool.enqueue([i, &universe, &p]{
+					universe.body[i].calc_force(universe, i, p);
+				});
+			}
 		}
+		phases.mark(PHASE_FORCE_TASKS);
 		pool.wait_until_empty();
 		pool.wait_until_nothing_in_flight();
+		if(counting)
+			counters.end(COUNTED_FORCE, E::symmetric ? universe.len*(universe.len-1)/2 : universe.len*(universe.len-1));
+		phases.mark(PHASE_FORCE_BARRIER);
 		
-		for(uint i = 0; i < univ_idx.len; ++i){
-			pool.enqueue([i, &universe, &univ_idx]{
-				universe[univ_idx.arr[i]].calc_acc();
-				universe[univ_idx.arr[i]].calc_vel();
-				universe[univ_idx.arr[i]].update();
+		pool.trace_label("update");
+		for(uint i = 0; i < universe.len; ++i){
+			pool.enqueue([i, &universe, &p]{
+				if(E::symmetric)
+					gather_force(universe, i);
+				universe.body[i].calc_acc();
+				universe.body[i].calc_vel(p);
+				universe.body[i].update();
 			});
 		}
+		phases.mark(PHASE_UPDATE_TASKS);
 		pool.wait_until_empty();
 		pool.wait_until_nothing_in_flight();
+		phases.mark(PHASE_UPDATE_BARRIER);
 		
-		if(!PRINT_CSV){// && tick%10==0){
-			printf("%0*lu/%lu\r",pad_len,tick,tick_limit);
-			std::cout << std::flush;
-		}
+		telemetry.tick(tick, universe, keep_history ? &writer : nullptr);
+		phases.mark(PHASE_PROGRESS);
+		phases.end_tick();
+		phases.poll();
 	}
 	
-	fflush(bout);
-	fclose(bout);
-	free(bbuf);
-}
\ No newline at end of file
+	
+	if(PRINT_CSV)
+		csv.close();
+	if(checkpoint)
+		checkpointer.wait();
+	uint dropped = 0;
+	if(stream_name){
+		dropped = stream.dropped();
+		stream.close(true);
+	}
+	if(keep_history){
+		writer.close();
+		fclose(bout);
+	}
+	telemetry.close(universe, keep_history ? &writer : nullptr);
+	phases.dump(stderr);
+	phases.close();
+	if(counting && PRINT_CSV)
+		counters.report(stderr);
+	uint trace_dropped = 0;
+	FILE *trace_out = trace_path ? fopen(trace_path, "w") : nullptr;
+	if(trace_out){
+		trace_dropped = pool.write_trace(trace_out);
+		fclose(trace_out);
+	} else if(trace_path){
+		fprintf(stderr, "Could not write trace %s!\n", trace_path);
+	}
+	universe.release();
+	
+	if(!PRINT_CSV){
+		printf("\n");
+		if(keep_history)
+			printf("Wrote %lu bytes of history at %.1f MB/s, stalled %.3fs waiting on output\n", writer.bytes_written(), writer.mb_per_second(), writer.stall_seconds());
+		if(stream_name)
+			printf("Streamed %lu frames to %s, dropped %lu\n", tick_limit - first_tick - dropped, stream_name, dropped);
+		if(keep_history && info.encoding != ENCODING_FULL && writer.stats().frames)
+			printf("Encoded frames %.2fx smaller than full at %.1f MB/s per codec thread\n", writer.stats().ratio(), writer.stats().mb_per_second());
+		if(trace_out)
+			printf("Wrote pool trace to %s%s\n", trace_path, trace_dropped ? ", some events dropped (raise --trace-events)" : "");
+		if(counting)
+			counters.report(stdout);
+		if(checkpointer.taken)
+			printf("Took %lu checkpoints (%lu failed), stalled %.3fs for them, %.3fs at most\n", checkpointer.taken, checkpointer.failed,
+				std::chrono::duration<double>(checkpointer.stall).count(), std::chrono::duration<double>(checkpointer.max_stall).count());
+	}
+	if(counting)
+		counters.close();
+	return EXIT_SUCCESS;
+}
+
+/***
+*
+* Pick the engine instantiation matching the command line. Each level of the
+* dispatch resolves one template parameter.
+*
+***/
+template<int DIMS, typename Real, class Softening>
+int dispatch_kernel(int argc, char *argv[], const Params &p){
+	const char *kernel = get_opt(argc, argv, "kernel");
+	if(!kernel || !strcmp(kernel, "full"))
+		return simulate<Engine<DIMS, Real, Softening, false>>(argc, argv, p);
+	if(!strcmp(kernel, "symmetric"))
+		return simulate<Engine<DIMS, Real, Softening, true>>(argc, argv, p);
+	fprintf(stderr, "Unknown kernel \"%s\"!\n", kernel);
+	return EXIT_FAILURE;
+}
+
+template<int DIMS, typename Real>
+int dispatch_softening(int argc, char *argv[], const Params &p){
+	const char *softening = get_opt(argc, argv, "softening");
+	if(!softening || !strcmp(softening, PaddedSoftening::name))
+		return dispatch_kernel<DIMS, Real, PaddedSoftening>(argc, argv, p);
+	if(!strcmp(softening, PlummerSoftening::name))
+		return dispatch_kernel<DIMS, Real, PlummerSoftening>(argc, argv, p);
+	fprintf(stderr, "Unknown softening policy \"%s\"!\n", softening);
+	return EXIT_FAILURE;
+}
+
+template<int DIMS>
+int dispatch_precision(int argc, char *argv[], const Params &p){
+	const char *precision = get_opt(argc, argv, "precision");
+	if(!precision || !strcmp(precision, "double"))
+		return dispatch_softening<DIMS, double>(argc, argv, p);
+	if(!strcmp(precision, "float"))
+		return dispatch_softening<DIMS, float>(argc, argv, p);
+	fprintf(stderr, "Unknown precision \"%s\"!\n", precision);
+	return EXIT_FAILURE;
+}
+
+#ifndef NBODY_NO_MAIN //bench.cpp includes this file for the engine and brings its own main()
+int main(int argc, char *argv[]) {
+	Params p;
+	p.dt      = get_opt(argc, argv, "dt")      ? std::stod(get_opt(argc, argv, "dt"))      : DELTA_TIME;
+	p.grav    = get_opt(argc, argv, "grav")    ? std::stod(get_opt(argc, argv, "grav"))    : GRAV_CONST;
+	p.epsilon = get_opt(argc, argv, "epsilon") ? std::stod(get_opt(argc, argv, "epsilon")) : EPSILON;
+	p.dt_half    = p.dt * 0.5;
+	p.dt_sq_half = p.dt * p.dt * 0.5;
+	
+	int dims = get_opt(argc, argv, "dims") ? std::stoi(get_opt(argc, argv, "dims")) : DIMENSIONS;
+	if(dims == 2)
+		return dispatch_precision<2>(argc, argv, p);
+	if(dims == 3)
+		return dispatch_precision<3>(argc, argv, p);
+	fprintf(stderr, "Unsupported dimension count %d!\n", dims);
+	return EXIT_FAILURE;
+}
+#endif
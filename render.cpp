@@ -1,6 +1,6 @@
 /*
 g++ render.cpp -o render  -O3 -Wall -std=c++17 -L/usr/X11R6/lib -lm -lpthread -lX11
-./render <HISTORY FILE> 1 50000 | ffmpeg -framerate 60 -r 60 -y -f rawvideo -pixel_format gbrp -video_size 1920x1080 -i - <OUTPUT VIDEO FILE>
+./render <HISTORY FILE>|- 1 50000 [--azimuth=<DEGREES>] [--elevation=<DEGREES>] [--start=<TICK>] [--stream=<SHM NAME>] | ffmpeg -framerate 60 -r 60 -y -f rawvideo -pixel_format gbrp -video_size 1920x1080 -i - <OUTPUT VIDEO FILE>
 */
 
 #include <math.h>
@@ -11,9 +11,15 @@ g++ render.cpp -o render  -O3 -Wall -std=c++17 -L/usr/X11R6/lib -lm -lpthread -l
 #include <stdint.h>
 #include <stdlib.h>
 #include "CImg.h"
+#include "History.h"
+#include "Stream.h"
 
 #define uint uint64_t
 
+#ifndef PI
+#define PI (3.14159265358979323846)
+#endif
+
 namespace CImg = cimg_library;
 
 static const unsigned char WHITE[] = {255, 255, 255};
@@ -21,6 +27,27 @@ static const unsigned char WHITE[] = {255, 255, 255};
 static const unsigned char BLACK[] = {  0,   0,   0};
 //static const unsigned char BLACK[] = {  0};
 
+/***
+*
+* Look up an optional "--name" or "--name=value" argument.
+*
+* Returns the value, an empty string for a bare flag, or nullptr if absent.
+*
+***/
+const char *get_opt(int argc, char *argv[], const char *name){
+	size_t len = strlen(name);
+	for(int i = 1; i < argc; ++i){
+		const char *arg = argv[i];
+		if(strncmp(arg, "--", 2) || strncmp(arg+2, name, len))
+			continue;
+		if(arg[2+len] == '\0')
+			return arg+2+len;
+		if(arg[2+len] == '=')
+			return arg+3+len;
+	}
+	return nullptr;
+}
+
 std::string dtos(double x){
 	char *buf;
 	
@@ -34,14 +61,24 @@ std::string dtos(double x){
 	return out;
 }
 
-#pragma pack(push, 1)
-struct Header{
-	char blurb1[16];
-	uint body_count;
-	uint tick_count;
-	char blurb2[16];
+/***
+*
+* Read state of a history file, or of a live stream from the simulator
+* (Stream.h) when live is set: the reader, the history it is reading, the
+* number of bodies decoded from the current frame, and the screen axes proj_x
+* and proj_y that 3D vectors are projected onto.
+*
+***/
+struct History {
+	HistoryReader reader;
+	FrameStream   stream;
+	HistoryFrame  live_frame;
+	bool          live;
+	HistoryInfo   info;
+	uint    count;
+	double  proj_x[3];
+	double  proj_y[3];
 };
-#pragma pack(pop)
 
 #pragma pack(push, 1)
 struct Vector {
@@ -167,8 +204,6 @@ struct View {
 };
 
 void draw_body (CImg::CImg<unsigned char> &img, View &view, Body &body){
-	if(!body.radius)
-		return;
 	int col = view.x2c(body.pos.x);
 	int row = view.y2r(body.pos.y);
 	int rad = (int)(body.radius * view.invDeltaX());
@@ -181,21 +216,41 @@ void draw_body (CImg::CImg<unsigned char> &img, View &view, Body &body){
 
 /***
 *
-* Read the binary header.
-*
-* Returns 0 on success, 1 on failure
+* Orthographic projection: rotate by azimuth about the Z axis, then tilt the Z
+* axis towards the viewer by elevation. Zero for both looks straight down on
+* the X-Y plane, which is all there is for 2D histories.
 *
 ***/
-int read_header(Header &head, FILE *bin){
-	if(1 != fread(&head, sizeof(Header), 1, bin)){
-		//Could not read header at all.
-		return 1;
-	}
-	if(memcmp(head.blurb1, "NBODY SIMULATION", 16) || memcmp(head.blurb2, "UNIVERSE HISTORY", 16)){
-		//Blurbs do not match expected values, indicating a malformed simulation history binary.
-		return 1;
+void set_projection(History &hist, double azimuth, double elevation){
+	double a = azimuth*PI/180.0;
+	double e = elevation*PI/180.0;
+	hist.proj_x[0] = cos(a);
+	hist.proj_x[1] = -sin(a);
+	hist.proj_x[2] = 0;
+	hist.proj_y[0] = sin(a)*cos(e);
+	hist.proj_y[1] = cos(a)*cos(e);
+	hist.proj_y[2] = sin(e);
+}
+
+Vector project(History &hist, const double *v){
+	Vector out = {
+		hist.proj_x[0]*v[0] + hist.proj_x[1]*v[1],
+		hist.proj_y[0]*v[0] + hist.proj_y[1]*v[1]
+	};
+	if(hist.info.dims == 3){
+		out.x += hist.proj_x[2]*v[2];
+		out.y += hist.proj_y[2]*v[2];
 	}
-	return 0;
+	return out;
+}
+
+void decode_body(History &hist, const double *src, Body &body){
+	body.mass   = src[0];
+	body.radius = src[1];
+	uint dims   = hist.info.dims;
+	body.pos    = project(hist, &src[2 + 0*dims]);
+	body.vel    = project(hist, &src[2 + 1*dims]);
+	body.acc    = project(hist, &src[2 + 2*dims]);
 }
 
 /***
@@ -206,18 +261,20 @@ int read_header(Header &head, FILE *bin){
 *	(Proper EOF := EOF occurs at the end of a simulation frame)
 *
 ***/
-int next_frame(Body *universe, Body &barycenter, Header &head, FILE *bin){
-	size_t read_count = fread(universe, sizeof(Body), head.body_count, bin);
-	if(head.body_count!=read_count){
-		if(read_count == 0){
-			return 1; //Proper EOF
-		} else {
-			return 2; //Couldn't read, or an EOF occurs mid-frame
-		}
-	}
-	if(1!=fread(&barycenter, sizeof(Body), 1, bin)){
-		return 2; //Couldn't read, or an EOF occurs mid-frame
+int next_frame(Body *universe, Body &barycenter, History &hist){
+	int status = hist.live ? hist.stream.next(hist.live_frame) : hist.reader.next_frame();
+	if(status)
+		return status;
+	HistoryInfo  &info  = hist.info;
+	HistoryFrame &frame = hist.live ? hist.live_frame : hist.reader.frame;
+	hist.count = 0;
+	for(uint i = 0; i < frame.count; ++i){
+		const double *src = &frame.body[i*info.body_doubles()];
+		if(info.version < 4 && !src[1])
+			continue; //Versions 1 to 3 keep dead bodies as zeroed slots
+		decode_body(hist, src, universe[hist.count++]);
 	}
+	decode_body(hist, frame.barycenter(info), barycenter);
 	return 0;
 }
 
@@ -230,9 +287,9 @@ void output_frame(CImg::CImg<unsigned char> &image, View &view){
 	std::cout.write(s,view.pixels());                               // Output it
 }
 
-void process_frame(Body *universe, Body &barycenter, uint current_tick, CImg::CImg<unsigned char> &image, Header &head, View &view){
+void process_frame(Body *universe, Body &barycenter, uint current_tick, CImg::CImg<unsigned char> &image, History &hist, View &view){
 	image.fill(0);
-	for(uint i = 0; i < head.body_count; ++i){
+	for(uint i = 0; i < hist.count; ++i){
 		//std::cout << "TICK " << current_tick << " BODY " << i << " POS: (" << universe[i].pos.to_string() << ')' << " RADIUS: " << universe[i].radius << std::endl;
 		//std::cout << "TICK " << current_tick << " BODY " << i << " VEL: (" << universe[i].vel.to_string() << ')' << std::endl;
 		//std::cout << "TICK " << current_tick << " BODY " << i << " ACC: (" << universe[i].acc.to_string() << ')' << std::endl;
@@ -263,13 +320,27 @@ int main(int argc, char *argv[]) {
 	CImg::CImg<unsigned char> image(view.w,view.h,1,3);
 	image.fill(0);
 	
-	Header head;
-	if(read_header(head, bin)){
-		std::cerr << "Could not read header!" << std::endl;
-		return EXIT_FAILURE;
+	History hist;
+	hist.live = get_opt(argc, argv, "stream");
+	if(hist.live){
+		if(!hist.stream.attach(get_opt(argc, argv, "stream"))){
+			std::cerr << "Could not attach to stream!" << std::endl;
+			return EXIT_FAILURE;
+		}
+		hist.info = hist.stream.info;
+		hist.live_frame.allocate(hist.info);
+	} else {
+		if(hist.reader.open(bin)){
+			std::cerr << "Could not read header!" << std::endl;
+			return EXIT_FAILURE;
+		}
+		hist.info = hist.reader.info;
 	}
+	set_projection(hist,
+		get_opt(argc, argv, "azimuth")   ? std::stod(get_opt(argc, argv, "azimuth"))   : 0,
+		get_opt(argc, argv, "elevation") ? std::stod(get_opt(argc, argv, "elevation")) : 0);
 	
-	Body *universe = (Body*) malloc(head.body_count * sizeof(Body));
+	Body *universe = (Body*) malloc(hist.info.body_count * sizeof(Body));
 	Body barycenter;
 	int  status; //Tracks the status of the simulation readback. 0=good to go, 1=expected EOF, 2=error
 	uint current_tick = 0;
@@ -277,13 +348,37 @@ int main(int argc, char *argv[]) {
 	uint decimation_rate = argc > 2 ? std::stoull(argv[2]) : 1;
 	uint max_tick		 = argc > 3 ? std::stoull(argv[3]) : 1;
 	
+	//Chunked histories are read through a memory map, jumping straight to the frames drawn
+	bool seekable = !hist.live && hist.reader.map_file();
+	if(!hist.live)
+		hist.reader.set_stride(decimation_rate);
+	
+	if(get_opt(argc, argv, "start") && !hist.live){
+		current_tick = std::stoull(get_opt(argc, argv, "start"));
+		if(hist.reader.seek(current_tick)){
+			std::cerr << "Could not seek to tick " << current_tick << "!" << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	
 	/*Read in and process all the frames sequentially*/
-	while(!(status=next_frame(universe, barycenter, head, bin))){
+	while(!(status=next_frame(universe, barycenter, hist))){
+		if(hist.live)
+			current_tick = hist.stream.tick; //The simulator may have dropped frames
 		if(decimation_rate==1 || current_tick%decimation_rate == 0)
-			process_frame(universe, barycenter, current_tick, image, head, view);
+			process_frame(universe, barycenter, current_tick, image, hist, view);
 		current_tick++;
-		if(current_tick == max_tick)
+		if(current_tick >= max_tick)
 			break;
+		if(seekable && current_tick%decimation_rate){
+			current_tick += decimation_rate - current_tick%decimation_rate;
+			if(current_tick >= max_tick || current_tick >= hist.reader.info.tick_count)
+				break;
+			if(hist.reader.seek(current_tick)){
+				status = 2;
+				break;
+			}
+		}
 	}
 	
 	/*Check if read/process loop ended due to an error when reading*/
@@ -292,6 +387,16 @@ int main(int argc, char *argv[]) {
 		return EXIT_FAILURE;
 	}
 	
+	if(hist.live){
+		fprintf(stderr, "Read frames up to tick %lu live, %lu dropped by the simulator\n", current_tick, hist.stream.dropped());
+		hist.stream.close(false);
+		hist.live_frame.release();
+	} else {
+		if(hist.reader.info.encoding != ENCODING_FULL && hist.reader.codec.frames)
+			fprintf(stderr, "Decoded %lu frames, %.2fx smaller than full, at %.1f MB/s\n", hist.reader.codec.frames.load(), hist.reader.codec.ratio(), hist.reader.codec.mb_per_second());
+		hist.reader.close();
+	}
+	
 	image.save("./orbit.bmp");
 	
 	return EXIT_SUCCESS;